@@ -22,3 +22,53 @@ void clockWait(uint8_t time) {
 		}
 	}
 }
+
+static uint16_t clock_last;
+static uint16_t clock_rest;
+static unsigned int clock_elapsed;
+
+void clockStart(void) {
+
+	clock_last = CLOCK_T1VALUE;
+	clock_rest = 0;
+	clock_elapsed = 0;
+}
+
+unsigned int clockElapsed(void) {
+
+	uint16_t now = CLOCK_T1VALUE;
+
+	clock_rest += (uint16_t) (now - clock_last);
+	clock_last = now;
+
+	while (clock_rest >= (uint16_t) CLOCK_T_320us) {
+		clock_rest -= (uint16_t) CLOCK_T_320us;
+		clock_elapsed++;
+	}
+
+	return clock_elapsed;
+}
+
+uint8_t clockTargetOutput(uint8_t divider) {
+
+#ifdef CLOCK_TARGET_BIT
+	TCCR2B = 0;
+
+	if (divider == 0) {
+		TCCR2A = 0;
+		CLOCK_TARGET_DDR &= ~(1 << CLOCK_TARGET_BIT);
+		return 0;
+	}
+
+	/* CTC mode, OC2B toggles every OCR2A + 1 cycles */
+	OCR2A = divider / 2 - 1;
+	OCR2B = 0;
+	TCCR2A = (1 << COM2B0) | (1 << WGM21);
+	TCCR2B = (1 << CS20);
+	CLOCK_TARGET_DDR |= (1 << CLOCK_TARGET_BIT);
+
+	return 0;
+#else
+	return 1;
+#endif
+}
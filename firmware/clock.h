@@ -18,15 +18,37 @@
 #define TIMERVALUE      TCNT0
 #define CLOCK_T_320us	(320e-6*F_CPU/64) /* prescaler is 64 as defined below */
 
+/* timer 1 runs with the same prescaler and wraps after 262 ms (16 MHz),
+   timer 0 already after 1 ms */
+#define CLOCK_T1VALUE   TCNT1
+
 
 #ifdef __AVR_ATmega8__
 #define TCCR0B  TCCR0
 #endif
 
-/* set prescaler to 64 */
-#define clockInit()  TCCR0B = (1 << CS01) | (1 << CS00);
+/* set prescaler of timer 0 and timer 1 to 64 */
+#define clockInit()  TCCR0B = (1 << CS01) | (1 << CS00); \
+	TCCR1B = (1 << CS11) | (1 << CS10);
 
 /* wait time * 320 us */
 void clockWait(uint8_t time);
 
+/* start measuring time for clockElapsed() */
+void clockStart(void);
+
+/* 320 us units since clockStart(). uses timer 1, so the calls may be up to
+   200 ms apart: long enough for an ISP instruction at the slowest SCK */
+unsigned int clockElapsed(void);
+
+#ifdef OCR2B
+/* target clock output OC2B (PD3), timer 2. OC2 of the ATmega8 is MOSI */
+#define CLOCK_TARGET_DDR DDRD
+#define CLOCK_TARGET_BIT PD3
+#endif
+
+/* clock output for the target, F_CPU / divider (2, 4 or 8), 0 switches it
+   off. returns 1 if not available */
+uint8_t clockTargetOutput(uint8_t divider);
+
 #endif /* __clock_h_included__ */
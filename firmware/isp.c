@@ -10,38 +10,142 @@
  */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "isp.h"
 #include "clock.h"
 #include "usbasp.h"
 
 #define spiHWdisable() SPCR = 0
 
+#ifdef ISP_USART_SPI
+#ifndef UBRR0
+#error "ISP_USART_SPI needs a USART with SPI master mode (ATmega88/168)"
+#endif
+#ifdef __AVR_ATmega48__
+#error "ISP_USART_SPI doesn't fit into the ATmega48 SRAM, use ATmega88/168"
+#endif
+
+/* baud register for SCK f, rounded down to not exceed f */
+#define USART_UBRR(f) ((F_CPU + 2 * (f) - 1) / (2 * (f)) - 1)
+
+/* UBRR0 for USBASP_ISP_SCK_2 .. USBASP_ISP_SCK_FCPU_2 */
+static const uint16_t usart_ubrr[] PROGMEM = {
+	USART_UBRR(2000UL), USART_UBRR(4000UL), USART_UBRR(8000UL),
+	USART_UBRR(16000UL), USART_UBRR(32000UL), USART_UBRR(93750UL),
+	USART_UBRR(187500UL), USART_UBRR(375000UL), USART_UBRR(750000UL),
+	USART_UBRR(1500000UL), USART_UBRR(2000000UL), 1, 0
+};
+
+uint16_t sck_ubrr;
+#endif
+
+/* signature reads compared by ispCheckSignature */
+#define ISP_PROBE_COUNT 4
+
+/* instruction bytes 0..2 reading the USBASP_IDENT_* entries in order */
+static const uchar ident_cmd[USBASP_IDENT_SIZE][3] PROGMEM = {
+	{ 0x30, 0x00, 0x00 }, { 0x30, 0x00, 0x01 }, { 0x30, 0x00, 0x02 },
+	{ 0x50, 0x00, 0x00 }, { 0x58, 0x08, 0x00 }, { 0x50, 0x08, 0x00 },
+	{ 0x58, 0x00, 0x00 }, { 0x38, 0x00, 0x00 }, { 0x38, 0x00, 0x01 },
+	{ 0x38, 0x00, 0x02 }, { 0x38, 0x00, 0x03 }
+};
+
+/* transmit queue of interrupt driven SPI, size must be power of 2. The
+   interrupt handler is in isp_stream.S, it has to start with sei */
+#define ISP_QUEUE_SIZE 16
+
 uchar sck_sw_delay;
 uchar sck_spcr;
 uchar sck_spsr;
 uchar isp_hiaddr;
+uchar isp_sck;
+uchar isp_options;
+uchar isp_pagedirty;
+uchar isp_gang = 0x01;
+uchar isp_gangsel = 0x01;
+
+volatile uchar isp_queue[ISP_QUEUE_SIZE];
+volatile uchar isp_qhead;
+volatile uchar isp_qtail;
+volatile uchar isp_qbusy;
+volatile uchar isp_qlast;
 
 void spiHWenable() {
 	SPCR = sck_spcr;
 	SPSR = sck_spsr;
 }
 
+#ifdef ISP_USART_SPI
+void usartSPIenable() {
+	/* init sequence of datasheet: baud 0 while enabling, XCK output
+	   selects master mode */
+	UBRR0 = 0;
+	ISP_USART_DDR |= (1 << ISP_USART_XCK);
+	/* SPI master mode 0, MSB first */
+	UCSR0C = (1 << UMSEL01) | (1 << UMSEL00);
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	UBRR0 = sck_ubrr;
+}
+
+void usartSPIdisable() {
+	UCSR0B = 0;
+	UCSR0C = 0;
+	ISP_USART_DDR &= ~(1 << ISP_USART_XCK);
+	ISP_USART_OUT &= ~(1 << ISP_USART_XCK);
+}
+#endif
+
 void ispSetSCKOption(uchar option) {
 
 	if (option == USBASP_ISP_SCK_AUTO)
 		option = USBASP_ISP_SCK_375;
 
+#ifndef ISP_USART_SPI
+	/* 2MHz needs the USART, use next lower hardware SPI SCK */
+	if (option == USBASP_ISP_SCK_2000)
+		option = USBASP_ISP_SCK_1500;
+#endif
+
+	isp_sck = option;
+
+#ifdef ISP_USART_SPI
+	if ((option >= USBASP_ISP_SCK_2) && (option <= USBASP_ISP_SCK_FCPU_2)) {
+		ispTransmit = ispTransmit_usart;
+		ispTransmitBlock = ispTransmitBlock_usart;
+		sck_ubrr = pgm_read_word(&usart_ubrr[option - USBASP_ISP_SCK_2]);
+
+		/* RST#/SCK pulse like software SPI, 48 at 2kHz */
+		if (option >= USBASP_ISP_SCK_93_75) {
+			sck_sw_delay = 1;
+		} else {
+			sck_sw_delay = 48 >> (option - USBASP_ISP_SCK_2);
+		}
+		return;
+	}
+#endif
+
 	if (option >= USBASP_ISP_SCK_93_75) {
 		ispTransmit = ispTransmit_hw;
+		ispTransmitBlock = ispTransmitBlock_hw;
 		sck_spsr = 0;
 		sck_sw_delay = 1;	/* force RST#/SCK pulse for 320us */
 
 		switch (option) {
 
+		case USBASP_ISP_SCK_FCPU_2:
+			/* enable SPI, master, 6MHz, XTAL/2 */
+			sck_spcr = (1 << SPE) | (1 << MSTR);
+			sck_spsr = (1 << SPI2X);
+			break;
+		case USBASP_ISP_SCK_FCPU_4:
+			/* enable SPI, master, 3MHz, XTAL/4 */
+			sck_spcr = (1 << SPE) | (1 << MSTR);
+			break;
 		case USBASP_ISP_SCK_1500:
 			/* enable SPI, master, 1.5MHz, XTAL/8 */
 			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR0);
 			sck_spsr = (1 << SPI2X);
+			break;
 		case USBASP_ISP_SCK_750:
 			/* enable SPI, master, 750kHz, XTAL/16 */
 			sck_spcr = (1 << SPE) | (1 << MSTR) | (1 << SPR0);
@@ -64,6 +168,7 @@ void ispSetSCKOption(uchar option) {
 
 	} else {
 		ispTransmit = ispTransmit_sw;
+		ispTransmitBlock = ispTransmitBlock_sw;
 		switch (option) {
 
 		case USBASP_ISP_SCK_32:
@@ -98,6 +203,20 @@ void ispSetSCKOption(uchar option) {
 	}
 }
 
+#ifdef ISP_USART_SPI
+void ispSetSCKDivider(unsigned int divider) {
+
+	isp_sck = USBASP_ISP_SCK_AUTO;
+	ispTransmit = ispTransmit_usart;
+	ispTransmitBlock = ispTransmitBlock_usart;
+	sck_ubrr = (divider >> 1) - 1;
+
+	/* RST#/SCK pulse like software SPI: half SCK period in timer ticks
+	   (prescaler 64) */
+	sck_sw_delay = (divider >> 7) + 1;
+}
+#endif
+
 void ispDelay() {
 
 	uint8_t starttime = TIMERVALUE;
@@ -105,39 +224,77 @@ void ispDelay() {
 	}
 }
 
+/* drive RST of selected targets, other gang targets are held high */
+static void ispResetTargets(uchar high) {
+
+	uchar low = high ? 0 : isp_gangsel;
+
+	if (low & 0x01) {
+		ISP_OUT &= ~(1 << ISP_RST);
+	} else {
+		ISP_OUT |= (1 << ISP_RST);
+	}
+	ISP_GANG_OUT = (ISP_GANG_OUT | ISP_GANG_PINS(isp_gang))
+			& ~ISP_GANG_PINS(low);
+}
+
 void ispConnect() {
 
 	/* all ISP pins are inputs before */
 	/* now set output pins */
+#ifdef ISP_USART_SPI
+	if (ispTransmit == ispTransmit_usart) {
+		/* MOSI and SCK are driven by the USART */
+		ISP_DDR |= (1 << ISP_RST);
+		ISP_USART_DDR |= (1 << ISP_USART_XCK);
+	} else
+#endif
 	ISP_DDR |= (1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI);
+	ISP_GANG_DDR |= ISP_GANG_PINS(isp_gang);
 
-	/* reset device */
-	ISP_OUT &= ~(1 << ISP_RST); /* RST low */
+	/* reset all gang targets */
+	isp_gangsel = isp_gang;
+	ispResetTargets(0); /* RST low */
 	ISP_OUT &= ~(1 << ISP_SCK); /* SCK low */
 
 	/* positive reset pulse > 2 SCK (target) */
 	ispDelay();
-	ISP_OUT |= (1 << ISP_RST); /* RST high */
+	ispResetTargets(1); /* RST high */
 	ispDelay();
-	ISP_OUT &= ~(1 << ISP_RST); /* RST low */
+	ispResetTargets(0); /* RST low */
 
 	if (ispTransmit == ispTransmit_hw) {
 		spiHWenable();
 	}
+#ifdef ISP_USART_SPI
+	if (ispTransmit == ispTransmit_usart) {
+		usartSPIenable();
+	}
+#endif
 	
 	/* Initial extended address value */
 	isp_hiaddr = 0;
+
+	/* nothing loaded into page buffer yet */
+	isp_pagedirty = 0;
 }
 
 void ispDisconnect() {
 
+	ispQueueFlush();
+
 	/* set all ISP pins inputs */
 	ISP_DDR &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
 	/* switch pullups off */
 	ISP_OUT &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI));
+	ISP_GANG_DDR &= ~ISP_GANG_PINS(isp_gang);
+	ISP_GANG_OUT &= ~ISP_GANG_PINS(isp_gang);
 
 	/* disable hardware SPI */
 	spiHWdisable();
+#ifdef ISP_USART_SPI
+	usartSPIdisable();
+#endif
 }
 
 uchar ispTransmit_sw(uchar send_byte) {
@@ -172,6 +329,7 @@ uchar ispTransmit_sw(uchar send_byte) {
 }
 
 uchar ispTransmit_hw(uchar send_byte) {
+	ispQueueFlush();
 	SPDR = send_byte;
 
 	while (!(SPSR & (1 << SPIF)))
@@ -179,36 +337,404 @@ uchar ispTransmit_hw(uchar send_byte) {
 	return SPDR;
 }
 
+void ispTransmitBlock_sw(uchar *buffer, uchar len) {
+
+	while (len--) {
+		*buffer = ispTransmit_sw(*buffer);
+		buffer++;
+	}
+}
+
+void ispTransmitBlock_hw(uchar *buffer, uchar len) {
+
+	uchar *rx = buffer;
+	uchar next;
+
+	ispQueueFlush();
+	SPDR = *buffer++;
+
+	while (--len) {
+		/* fetch next byte while the current one is shifted out */
+		next = *buffer++;
+
+		while (!(SPSR & (1 << SPIF)))
+			;
+		*rx++ = SPDR;
+		SPDR = next;
+	}
+
+	while (!(SPSR & (1 << SPIF)))
+		;
+	*rx = SPDR;
+}
+
+#ifdef ISP_USART_SPI
+uchar ispTransmit_usart(uchar send_byte) {
+	UDR0 = send_byte;
+
+	while (!(UCSR0A & (1 << RXC0)))
+		;
+	return UDR0;
+}
+
+void ispTransmitBlock_usart(uchar *buffer, uchar len) {
+
+	uchar *rx = buffer;
+	uchar txlen = len;
+
+	/* transmit buffer is refilled as soon as it's free, so bytes follow
+	   without gap. Received bytes overwrite already sent ones */
+	while (len) {
+		if (txlen && (UCSR0A & (1 << UDRE0))) {
+			UDR0 = *buffer++;
+			txlen--;
+		}
+		if (UCSR0A & (1 << RXC0)) {
+			*rx++ = UDR0;
+			len--;
+		}
+	}
+}
+#endif
+
+uchar ispCommand(uchar b0, uchar b1, uchar b2, uchar b3) {
+
+	uchar cmd[4];
+
+	cmd[0] = b0;
+	cmd[1] = b1;
+	cmd[2] = b2;
+	cmd[3] = b3;
+	ispTransmitBlock(cmd, 4);
+
+	return cmd[3];
+}
+
+void ispQueueByte(uchar send_byte) {
+
+	uchar head = (isp_qhead + 1) & (ISP_QUEUE_SIZE - 1);
+
+	/* wait for free entry */
+	while (head == isp_qtail) {
+	}
+
+	/* SPI interrupt off while queue is changed */
+	SPCR &= ~(1 << SPIE);
+
+	if (isp_qbusy) {
+		isp_queue[isp_qhead] = send_byte;
+		isp_qhead = head;
+	} else {
+		isp_qbusy = 1;
+		SPDR = send_byte;
+	}
+
+	SPCR |= (1 << SPIE);
+}
+
+void ispQueueCommand(uchar b0, uchar b1, uchar b2, uchar b3) {
+
+	if (ispTransmit != ispTransmit_hw) {
+		ispCommand(b0, b1, b2, b3);
+		return;
+	}
+
+	ispQueueByte(b0);
+	ispQueueByte(b1);
+	ispQueueByte(b2);
+	ispQueueByte(b3);
+}
+
+uchar ispQueueFlush() {
+
+	while (isp_qbusy) {
+	}
+
+	return isp_qlast;
+}
+
+uchar ispPoll(uchar *cmd, uchar mask, uchar value, uchar timeout) {
+
+	/* an instruction takes 4 ms at 8 kHz SCK: timer 0 would wrap */
+	clockStart();
+
+	while ((ispCommand(cmd[0], cmd[1], cmd[2], cmd[3]) & mask) != value) {
+
+		if (clockElapsed() >= timeout)
+			return 1; /* error */
+	}
+
+	return 0;
+}
+
+uchar ispWaitReady(uchar timeout) {
+
+	uchar cmd[4] = { 0xF0, 0x00, 0x00, 0x00 };
+
+	/* several targets answer at once, wait for the slowest one */
+	if (ispGangBroadcast()) {
+		clockWait(timeout);
+		return 0;
+	}
+
+	/* bit 0 of the "Poll RDY/BSY" answer is set while target is busy */
+	return ispPoll(cmd, 0x01, 0x00, timeout);
+}
+
+#ifdef ISP_SCRIPT
+uchar ispRunScript(uchar *script, uchar len, uchar *result, uchar size) {
+
+	uchar *end = script + len;
+	uchar status = USBASP_SCRIPT_OK;
+	uchar n = 1;
+	uchar oplen, count;
+	unsigned int address;
+
+	while ((script < end) && (status == USBASP_SCRIPT_OK)) {
+
+		switch (*script++) {
+		case USBASP_SCRIPT_END:
+			end = script;
+			oplen = 0;
+			break;
+		case USBASP_SCRIPT_WAIT:
+			oplen = 1;
+			break;
+		case USBASP_SCRIPT_SEND:
+		case USBASP_SCRIPT_CAPTURE:
+		case USBASP_SCRIPT_READRANGE:
+			oplen = 4;
+			break;
+		case USBASP_SCRIPT_POLL:
+			oplen = 7;
+			break;
+		default:
+			oplen = 0xff;
+		}
+
+		/* unknown opcode or operands missing */
+		if (oplen > end - script) {
+			status = USBASP_SCRIPT_INVALID;
+			break;
+		}
+
+		switch (script[-1]) {
+		case USBASP_SCRIPT_SEND:
+			ispCommand(script[0], script[1], script[2], script[3]);
+			break;
+		case USBASP_SCRIPT_CAPTURE:
+			if (n == size) {
+				status = USBASP_SCRIPT_FULL;
+				break;
+			}
+			result[n++] = ispCommand(script[0], script[1], script[2],
+					script[3]);
+			break;
+		case USBASP_SCRIPT_WAIT:
+			clockWait(script[0]);
+			break;
+		case USBASP_SCRIPT_POLL:
+			if (ispPoll(script, script[4], script[5], script[6])) {
+				status = USBASP_SCRIPT_TIMEOUT;
+			}
+			break;
+		case USBASP_SCRIPT_READRANGE:
+			address = (script[1] << 8) | script[2];
+			for (count = script[3]; count != 0; count--) {
+				if (n == size) {
+					status = USBASP_SCRIPT_FULL;
+					break;
+				}
+				result[n++] = ispCommand(script[0], address >> 8, address,
+						0x00);
+				address++;
+			}
+			break;
+		}
+
+		script += oplen;
+	}
+
+	result[0] = status;
+	return n;
+}
+#endif
+
+/* pulse RST of selected targets with SCK held low */
+static void ispPulseReset(void) {
+
+	ispQueueFlush();
+	spiHWdisable();
+#ifdef ISP_USART_SPI
+	/* keep SCK low while USART is off */
+	UCSR0B = 0;
+#endif
+
+	ispDelay();
+	ispResetTargets(1); /* RST high */
+	ispDelay();
+	ispResetTargets(0); /* RST low */
+	ispDelay();
+
+	if (ispTransmit == ispTransmit_hw) {
+		spiHWenable();
+	}
+#ifdef ISP_USART_SPI
+	if (ispTransmit == ispTransmit_usart) {
+		usartSPIenable();
+	}
+#endif
+}
+
 uchar ispEnterProgrammingMode() {
-	uchar check;
+	uchar cmd[4];
 	uchar count = 32;
 
 	while (count--) {
-		ispTransmit(0xAC);
-		ispTransmit(0x53);
-		check = ispTransmit(0);
-		ispTransmit(0);
+		cmd[0] = 0xAC;
+		cmd[1] = 0x53;
+		cmd[2] = 0;
+		cmd[3] = 0;
+		ispTransmitBlock(cmd, 4);
 
-		if (check == 0x53) {
+		if (cmd[2] == 0x53) {
 			return 0;
 		}
 
-		spiHWdisable();
+		ispPulseReset();
+	}
 
-		/* pulse RST */
-		ispDelay();
-		ISP_OUT |= (1 << ISP_RST); /* RST high */
-		ispDelay();
-		ISP_OUT &= ~(1 << ISP_RST); /* RST low */
-		ispDelay();
+	return 1; /* error: device dosn't answer */
+}
+
+uchar ispCheckSignature() {
 
-		if (ispTransmit == ispTransmit_hw) {
-			spiHWenable();
+	uchar signature[3];
+	uchar value;
+	uchar i, n;
+
+	for (n = 0; n < ISP_PROBE_COUNT; n++) {
+		for (i = 0; i < 3; i++) {
+			value = ispCommand(0x30, 0x00, i, 0x00);
+			if (n == 0) {
+				signature[i] = value;
+			} else if (value != signature[i]) {
+				return 1; /* bit errors, SCK too fast */
+			}
 		}
+	}
 
+	/* MISO stuck low or high */
+	if ((signature[0] == 0x00) || (signature[0] == 0xFF)) {
+		return 1;
 	}
 
-	return 1; /* error: device dosn't answer */
+	return 0;
+}
+
+uchar ispChipErase(unsigned int timeout, unsigned int *elapsed) {
+
+	unsigned int ticks;
+	uchar busy = 1;
+
+	ispCommand(0xAC, 0x80, 0x00, 0x00);
+	clockStart();
+
+	do {
+		ticks = clockElapsed();
+		if (ticks >= timeout) {
+			break;
+		}
+
+		if (ispGangBroadcast()) {
+			busy = 1; /* no answer to poll, wait for timeout */
+		} else if (isp_options & USBASP_OPT_RDYBSY) {
+			busy = ispCommand(0xF0, 0x00, 0x00, 0x00) & 0x01;
+		} else {
+			/* target doesn't answer with the vendor code while erasing,
+			   but may do so before the erase has started: wait t_WD_ERASE */
+			busy = (ticks < ISP_ERASE_MINTIME)
+					|| (ispCommand(0x30, 0x00, 0x00, 0x00) != 0x1E);
+		}
+	} while (busy);
+
+	*elapsed = clockElapsed();
+	return busy && !ispGangBroadcast();
+}
+
+void ispReadIdentity(uchar *buffer) {
+
+	uchar i;
+
+	for (i = 0; i < USBASP_IDENT_SIZE; i++) {
+		buffer[i] = ispCommand(pgm_read_byte(&ident_cmd[i][0]),
+				pgm_read_byte(&ident_cmd[i][1]),
+				pgm_read_byte(&ident_cmd[i][2]), 0x00);
+	}
+}
+
+#ifdef ISP_GANG
+uchar ispGangEnter(uchar mask) {
+
+	uchar result = 0;
+
+	isp_gangsel = mask;
+	ispPulseReset();
+
+	if (ispGangBroadcast()) {
+		/* answers can't be checked, each target answered at this SCK */
+		ispCommand(0xAC, 0x53, 0x00, 0x00);
+	} else if (mask != 0) {
+		result = ispEnterProgrammingMode();
+	}
+
+	/* reset cleared extended address and page buffer of the targets */
+	isp_hiaddr = 0;
+	isp_pagedirty = 0;
+
+	return result;
+}
+
+uchar ispGangSelect(uchar mask) {
+
+	uchar target;
+	uchar selected = 0;
+
+	mask &= isp_gang;
+
+	/* one by one, others are held in reset high */
+	for (target = 0x01; target & ISP_GANG_MASK; target <<= 1) {
+		if ((mask & target) && (ispGangEnter(target) == 0)
+				&& (ispCheckSignature() == 0)) {
+			selected |= target;
+		}
+	}
+
+	/* targets left programming mode while others were probed */
+	ispGangEnter(selected);
+
+	return selected;
+}
+#endif
+
+uchar ispEnterProgrammingModeAuto(uchar option, uchar slowest) {
+
+	for (; option >= slowest; option--) {
+
+		/* reconnect with next SCK */
+		ispDisconnect();
+		ispSetSCKOption(option);
+		if (isp_sck != option) {
+			continue; /* not available, mapped to a slower one */
+		}
+		ispConnect();
+
+		if ((ispEnterProgrammingMode() == 0) && (ispCheckSignature() == 0)) {
+			return 0;
+		}
+	}
+
+	return 1; /* error: device doesn't answer at any SCK */
 }
 
 static void ispUpdateExtended(unsigned long address)
@@ -222,10 +748,7 @@ static void ispUpdateExtended(unsigned long address)
 	{
 		isp_hiaddr = curr_hiaddr;
 		/* Load Extended Address byte */
-		ispTransmit(0x4D);
-		ispTransmit(0x00);
-		ispTransmit(isp_hiaddr);
-		ispTransmit(0x00);
+		ispCommand(0x4D, 0x00, isp_hiaddr, 0x00);
 	}
 }
 
@@ -233,31 +756,88 @@ uchar ispReadFlash(unsigned long address) {
 
 	ispUpdateExtended(address);
 
-	ispTransmit(0x20 | ((address & 1) << 3));
-	ispTransmit(address >> 9);
-	ispTransmit(address >> 1);
-	return ispTransmit(0);
+	return ispCommand(0x20 | ((address & 1) << 3), address >> 9, address >> 1,
+			0);
 }
 
-uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
+void ispReadFlashBlock(unsigned long address, uchar *buffer, uchar len) {
+
+	uchar n;
 
-	/* 0xFF is value after chip erase, so skip programming
-	 if (data == 0xFF) {
-	 return 0;
-	 }
-	 */
+	if (ispTransmit != ispTransmit_hw) {
+		while (len--) {
+			*buffer++ = ispReadFlash(address++);
+		}
+		return;
+	}
+
+	while (len) {
+		ispUpdateExtended(address);
+
+		/* stream up to next 128kB boundary, extended address byte changes */
+		n = len;
+		if ((address & 0x1FFFF) + len > 0x20000) {
+			n = 0x20000 - (address & 0x1FFFF);
+		}
+
+		ispQueueFlush();
+		isp_stream_read_flash(address >> 1, address & 1, buffer, n);
+
+		address += n;
+		buffer += n;
+		len -= n;
+	}
+}
+
+void ispLoadFlashPage(unsigned long address, uchar *buffer, uchar len) {
+
+	uchar flags;
+
+	if (ispTransmit != ispTransmit_hw) {
+		while (len--) {
+			ispWriteFlash(address++, *buffer++, 0);
+		}
+		return;
+	}
 
 	ispUpdateExtended(address);
+	ispQueueFlush();
 
-	ispTransmit(0x40 | ((address & 1) << 3));
-	ispTransmit(address >> 9);
-	ispTransmit(address >> 1);
-	ispTransmit(data);
+	/* bit 0: start with high byte, bit 1: skip 0xFF */
+	flags = address & 1;
+	if (isp_options & USBASP_OPT_ERASED) {
+		flags |= 0x02;
+	}
 
-	if (pollmode == 0)
+	if (isp_stream_load_flash(address >> 1, flags, buffer, len) != 0) {
+		isp_pagedirty = 1;
+	}
+}
+
+uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
+
+	/* 0xFF is value after chip erase, so skip programming */
+	if ((isp_options & USBASP_OPT_ERASED) && (data == 0xFF)) {
 		return 0;
+	}
+
+	isp_pagedirty = 1;
 
-	if (data == 0x7F) {
+	ispUpdateExtended(address);
+
+	if (pollmode == 0) {
+		/* page load, no answer needed: queue it and go on with USB */
+		ispQueueCommand(0x40 | ((address & 1) << 3), address >> 9,
+				address >> 1, data);
+		return 0;
+	}
+
+	ispCommand(0x40 | ((address & 1) << 3), address >> 9, address >> 1, data);
+
+	if (isp_options & USBASP_OPT_RDYBSY)
+		return ispWaitReady(30);
+
+	if ((data == 0x7F) || ispGangBroadcast()) {
 		clockWait(15); /* wait 4,8 ms */
 		return 0;
 	} else {
@@ -283,14 +863,20 @@ uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
 
 uchar ispFlushPage(unsigned long address, uchar pollvalue) {
 
+	/* page buffer is still blank, erased page doesn't need programming */
+	if ((isp_options & USBASP_OPT_ERASED) && !isp_pagedirty) {
+		return 0;
+	}
+	isp_pagedirty = 0;
+
 	ispUpdateExtended(address);
 	
-	ispTransmit(0x4C);
-	ispTransmit(address >> 9);
-	ispTransmit(address >> 1);
-	ispTransmit(0);
+	ispCommand(0x4C, address >> 9, address >> 1, 0);
+
+	if (isp_options & USBASP_OPT_RDYBSY)
+		return ispWaitReady(30);
 
-	if (pollvalue == 0xFF) {
+	if ((pollvalue == 0xFF) || ispGangBroadcast()) {
 		clockWait(15);
 		return 0;
 	} else {
@@ -317,18 +903,51 @@ uchar ispFlushPage(unsigned long address, uchar pollvalue) {
 }
 
 uchar ispReadEEPROM(unsigned int address) {
-	ispTransmit(0xA0);
-	ispTransmit(address >> 8);
-	ispTransmit(address);
-	return ispTransmit(0);
+	return ispCommand(0xA0, address >> 8, address, 0);
 }
 
 uchar ispWriteEEPROM(unsigned int address, uchar data) {
 
-	ispTransmit(0xC0);
-	ispTransmit(address >> 8);
-	ispTransmit(address);
-	ispTransmit(data);
+	ispCommand(0xC0, address >> 8, address, data);
+
+	if (isp_options & USBASP_OPT_RDYBSY)
+		return ispWaitReady(40);
+
+	/* 0xFF can't be polled, target reads 0xFF until write is done */
+	if ((isp_options & USBASP_OPT_EEPROM_POLL) && (data != 0xFF)
+			&& !ispGangBroadcast()) {
+
+		/* polling eeprom until it reads back the written byte */
+		uchar cmd[4] = { 0xA0, address >> 8, address, 0x00 };
+
+		return ispPoll(cmd, 0xFF, data, 40);
+	}
+
+	clockWait(30); // wait 9,6 ms
+
+	return 0;
+}
+
+void ispLoadEEPROMPage(unsigned int address, uchar data) {
+
+	ispQueueCommand(0xC1, 0x00, address, data);
+}
+
+uchar ispFlushEEPROMPage(unsigned int address, uchar pollvalue) {
+
+	ispCommand(0xC2, address >> 8, address, 0);
+
+	if (isp_options & USBASP_OPT_RDYBSY)
+		return ispWaitReady(40);
+
+	if ((isp_options & USBASP_OPT_EEPROM_POLL) && (pollvalue != 0xFF)
+			&& !ispGangBroadcast()) {
+
+		/* polling last byte of page */
+		uchar cmd[4] = { 0xA0, address >> 8, address, 0x00 };
+
+		return ispPoll(cmd, 0xFF, pollvalue, 40);
+	}
 
 	clockWait(30); // wait 9,6 ms
 
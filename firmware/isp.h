@@ -24,6 +24,27 @@
 #define ISP_MISO  PB4
 #define ISP_SCK   PB5
 
+/* Reset lines of gang targets 1..3 (target 0 is ISP_RST), PC3..PC5 */
+#define ISP_GANG_OUT  PORTC
+#define ISP_GANG_DDR  DDRC
+#define ISP_GANG_PINS(mask) (((mask) & 0x0E) << 2)
+#define ISP_GANG_MASK 0x0F
+
+/* more than one target selected, answers can't be told apart */
+#ifdef ISP_GANG
+#define ispGangBroadcast() (isp_gangsel & (isp_gangsel - 1))
+#else
+#define ispGangBroadcast() 0
+#endif
+
+/* USART in SPI master mode (ISP_USART_SPI builds, ATmega88/168).
+   TXD, RXD and XCK have to be wired to MOSI, MISO and SCK */
+#define ISP_USART_OUT PORTD
+#define ISP_USART_DDR DDRD
+#define ISP_USART_TXD PD1
+#define ISP_USART_RXD PD0
+#define ISP_USART_XCK PD4
+
 /* Prepare connection to target device */
 void ispConnect();
 
@@ -36,6 +57,32 @@ uchar ispTransmit_sw(uchar send_byte);
 /* read an write a byte from isp using hardware (fast) */
 uchar ispTransmit_hw(uchar send_byte);
 
+#ifdef ISP_USART_SPI
+/* read an write a byte from isp using USART in SPI mode */
+uchar ispTransmit_usart(uchar send_byte);
+
+/* read and write a block from isp using USART, transmitter kept busy */
+void ispTransmitBlock_usart(uchar *buffer, uchar len);
+#endif
+
+/* read and write a block from isp using software (slow) */
+void ispTransmitBlock_sw(uchar *buffer, uchar len);
+
+/* read and write a block from isp using hardware, bytes back-to-back (fast) */
+void ispTransmitBlock_hw(uchar *buffer, uchar len);
+
+/* send one 4 byte instruction, returns the last received byte */
+uchar ispCommand(uchar b0, uchar b1, uchar b2, uchar b3);
+
+/* queue byte for interrupt driven transmission (hardware SPI only) */
+void ispQueueByte(uchar send_byte);
+
+/* queue 4 byte instruction, sent immediately when using software SPI */
+void ispQueueCommand(uchar b0, uchar b1, uchar b2, uchar b3);
+
+/* wait until queue is sent, returns last received byte */
+uchar ispQueueFlush();
+
 /* enter programming mode */
 uchar ispEnterProgrammingMode();
 
@@ -50,15 +97,98 @@ uchar ispFlushPage(unsigned long address, uchar pollvalue);
 /* read byte from flash at given address */
 uchar ispReadFlash(unsigned long address);
 
+/* read block from flash at given address, streamed with hardware SPI */
+void ispReadFlashBlock(unsigned long address, uchar *buffer, uchar len);
+
+/* load block into flash page buffer at given address, block must not
+   cross the page end. streamed with hardware SPI */
+void ispLoadFlashPage(unsigned long address, uchar *buffer, uchar len);
+
+/* assembler kernels for hardware SPI, see isp_stream.S */
+void isp_stream_read_flash(unsigned int word, uchar highbyte, uchar *buffer,
+		uchar len);
+uchar isp_stream_load_flash(unsigned int word, uchar flags, uchar *buffer,
+		uchar len);
+
 /* write byte to eeprom at given address */
 uchar ispWriteEEPROM(unsigned int address, uchar data);
 
+/* load byte into eeprom page buffer at given address */
+void ispLoadEEPROMPage(unsigned int address, uchar data);
+
+/* write eeprom page buffer to the page of given address */
+uchar ispFlushEEPROMPage(unsigned int address, uchar pollvalue);
+
 /* pointer to sw or hw transmit function */
 uchar (*ispTransmit)(uchar);
 
+/* pointer to sw or hw block transmit function. The block is sent and
+   overwritten in place with the received bytes */
+void (*ispTransmitBlock)(uchar *, uchar);
+
+/* wait until target is ready by polling RDY/BSY, timeout in 320us units.
+   returns 1 on timeout */
+uchar ispWaitReady(uchar timeout);
+
+/* send instruction until (answer & mask) == value, timeout in 320us units.
+   returns 1 on timeout */
+uchar ispPoll(uchar *cmd, uchar mask, uchar value, uchar timeout);
+
+#ifdef ISP_SCRIPT
+/* run ISP script (see USBASP_SCRIPT_*), captured bytes are stored from
+   result[1] on, result[0] is the status. returns used size of result */
+uchar ispRunScript(uchar *script, uchar len, uchar *result, uchar size);
+#endif
+
+/* read signature several times, returns 0 if it is stable and valid */
+uchar ispCheckSignature();
+
+/* minimum chip erase time (t_WD_ERASE 9 ms) in 320us units */
+#define ISP_ERASE_MINTIME 29
+
+/* erase chip and wait for completion by RDY/BSY (USBASP_OPT_RDYBSY) or
+   signature polling. RDY/BSY reports the real erase time, signature
+   polling starts after ISP_ERASE_MINTIME and never reports less.
+   timeout and elapsed time in 320us units. returns 1 on timeout */
+uchar ispChipErase(unsigned int timeout, unsigned int *elapsed);
+
+/* read signature, fuses, lock and calibration bytes into buffer, layout
+   see USBASP_IDENT_* */
+void ispReadIdentity(uchar *buffer);
+
+/* enter programming mode at fastest SCK with stable signature reads,
+   steps down from given option to slowest. returns 1 on error */
+uchar ispEnterProgrammingModeAuto(uchar option, uchar slowest);
+
+/* SCK option currently in use */
+extern uchar isp_sck;
+
+/* session options, USBASP_OPT_* flags */
+extern uchar isp_options;
+
+/* gang targets in use and targets currently selected, bit n is target n */
+extern uchar isp_gang;
+extern uchar isp_gangsel;
+
+#ifdef ISP_GANG
+/* select targets of mask and enter programming mode after a reset pulse,
+   checked for a single target only. returns 1 on error */
+uchar ispGangEnter(uchar mask);
+
+/* enter programming mode on each target of mask, then select the ones
+   which answered together. returns mask of selected targets */
+uchar ispGangSelect(uchar mask);
+#endif
+
 /* set SCK speed. call before ispConnect! */
 void ispSetSCKOption(uchar sckoption);
 
+#ifdef ISP_USART_SPI
+/* set SCK to F_CPU / divider (even, 2..8192) on the USART. call before
+   ispConnect! */
+void ispSetSCKDivider(unsigned int divider);
+#endif
+
 /* load extended address byte */
 void ispLoadExtendedAddressByte(unsigned long address);
 
@@ -10,7 +10,9 @@
  *
  * PC2 SCK speed option.
  * GND  -> slow (8khz SCK),
- * open -> software set speed (default is 375kHz SCK)
+ * open -> software set speed (default is auto detection: one step below
+ *         the fastest SCK up to F_CPU/4 the target answers at, 375kHz SCK
+ *         before programming mode)
  */
 
 #include <avr/io.h>
@@ -18,6 +20,7 @@
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #include "usbasp.h"
 #include "usbdrv.h"
@@ -26,10 +29,14 @@
 #include "tpi.h"
 #include "tpi_defs.h"
 
-static uchar replyBuffer[8];
+static uchar replyBuffer[USBASP_IDENT_SIZE];
 
 static uchar prog_state = PROG_STATE_IDLE;
 static uchar prog_sck = USBASP_ISP_SCK_AUTO;
+static uchar prog_targetclock; /* divider of clock output, 0 if off */
+#ifdef ISP_USART_SPI
+static unsigned int prog_sckdivider; /* SCK divider instead of prog_sck */
+#endif
 
 static uchar prog_address_newmode = 0;
 static unsigned long prog_address;
@@ -38,15 +45,575 @@ static unsigned int prog_pagesize;
 static uchar prog_blockflags;
 static uchar prog_pagecounter;
 
+static uchar prog_buffer[PROG_BUFFER_SIZE]; /* copy of loaded page */
+static unsigned int prog_bufferpos;
+static unsigned long prog_verify_address;
+static unsigned int prog_verify_errors;
+static uchar prog_lastvalue;
+
+#ifdef ISP_SCRIPT
+static uchar prog_scriptlen; /* script in prog_buffer, results follow */
+static uchar prog_resultlen;
+#endif
+
+static uchar prog_event[USBASP_EVENT_SIZE]; /* next interrupt-in report */
+static uchar prog_eventpending;
+static unsigned int prog_pages;
+#ifdef ISP_GANG
+static uchar prog_gangerrors; /* gang targets which failed verify */
+#endif
+
+#ifdef PROG_STREAM
+static uchar prog_stream; /* flash data comes on interrupt-out endpoint */
+static uchar prog_streamtoken; /* data toggle of last packet */
+static uchar prog_streamstatus; /* page event status bits of the stream */
+
+/* configuration descriptor of V-USB with interrupt-out endpoint 1 added */
+PROGMEM const char usbDescriptorConfiguration[] = {
+	9, USBDESCR_CONFIG, 32, 0, /* total length */
+	1, 1, 0, (1 << 7), USB_CFG_MAX_BUS_POWER / 2,
+	9, USBDESCR_INTERFACE, 0, 0, 2, /* endpoints excl 0 */
+	USB_CFG_INTERFACE_CLASS, USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL, 0,
+	7, USBDESCR_ENDPOINT, (char) 0x81, 0x03, 8, 0, /* interrupt-in 1 */
+	USB_CFG_INTR_POLL_INTERVAL,
+	7, USBDESCR_ENDPOINT, 0x01, 0x03, 8, 0, /* interrupt-out 1 */
+	USB_CFG_INTR_POLL_INTERVAL
+};
+#endif
+
+static uchar prog_prefetch[8]; /* next packet of running read transfer */
+static uchar prog_prefetchlen;
+
+#ifdef PROG_LZ_WRITE
+static uchar prog_lzmode;
+static uchar lz_window[LZ_WINDOW_SIZE]; /* last decoded bytes */
+static uchar lz_pos;
+static uchar lz_state;
+static uchar lz_count;
+#endif
+
+/* count failed byte for USBASP_FUNC_GETVERIFYSTATUS */
+static void countError(unsigned long address) {
+
+	if (prog_verify_errors == 0) {
+		prog_verify_address = address;
+	}
+	if (prog_verify_errors != 0xFFFF) {
+		prog_verify_errors++;
+	}
+}
+
+/* read back the page loaded up to given address and compare it with
+   prog_buffer */
+static void verifyPage(unsigned long address) {
+
+	uchar block[8];
+	unsigned int i;
+	uchar j, n;
+
+	address = address + 1 - prog_bufferpos;
+
+	for (i = 0; (i < prog_bufferpos) && (i < PROG_BUFFER_SIZE); i += n) {
+
+		n = sizeof(block);
+		if (prog_bufferpos - i < n) {
+			n = prog_bufferpos - i;
+		}
+
+		if (prog_state == PROG_STATE_WRITEFLASH) {
+			ispReadFlashBlock(address, block, n);
+		} else {
+			for (j = 0; j < n; j++) {
+				block[j] = ispReadEEPROM(address + j);
+			}
+		}
+
+		for (j = 0; j < n; j++) {
+			if (block[j] != prog_buffer[i + j]) {
+				countError(address + j);
+			}
+		}
+
+		address += n;
+	}
+
+	/* page is larger than the copy, the rest can't be checked */
+	for (; i < prog_bufferpos; i++) {
+		countError(address++);
+	}
+
+	prog_bufferpos = 0;
+}
+
+/* read block from memory of given read state at prog_address */
+static void readBlock(uchar state, uchar *data, uchar len) {
+
+	uchar i;
+
+	/* TPI mode */
+	if (state == PROG_STATE_TPI_READ) {
+		tpi_read_block(prog_address, data, len);
+		prog_address += len;
+		return;
+	}
+
+	/* ISP mode */
+	if (state == PROG_STATE_READFLASH) {
+		ispReadFlashBlock(prog_address, data, len);
+		prog_address += len;
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		data[i] = ispReadEEPROM(prog_address);
+		prog_address++;
+	}
+}
+
+/* read next packet of running read transfer while the current one is sent */
+static void readAhead(void) {
+
+	if ((prog_prefetchlen != 0) || (prog_nbytes == 0)) {
+		return;
+	}
+
+	if ((prog_state != PROG_STATE_READFLASH) && (prog_state
+			!= PROG_STATE_READEEPROM) && (prog_state != PROG_STATE_TPI_READ)) {
+		return;
+	}
+
+	prog_prefetchlen = (prog_nbytes > 8) ? 8 : prog_nbytes;
+	readBlock(prog_state, prog_prefetch, prog_prefetchlen);
+	prog_nbytes -= prog_prefetchlen;
+}
+
+/* get read state for USBASP_MEM_* memory selector */
+static uchar memoryReadState(uchar memory) {
+
+	switch (memory & USBASP_MEM_MASK) {
+	case USBASP_MEM_FLASH:
+		return PROG_STATE_READFLASH;
+	case USBASP_MEM_EEPROM:
+		return PROG_STATE_READEEPROM;
+	case USBASP_MEM_TPI:
+		return PROG_STATE_TPI_READ;
+	}
+	return PROG_STATE_IDLE;
+}
+
+#ifdef PROG_CRC_32
+static unsigned long crc32Update(unsigned long crc, uchar data) {
+
+	uchar i;
+
+	crc ^= data;
+	for (i = 0; i < 8; i++) {
+		if (crc & 1) {
+			crc = (crc >> 1) ^ 0xEDB88320;
+		} else {
+			crc >>= 1;
+		}
+	}
+
+	return crc;
+}
+#endif
+
+/* calculate checksum over nbytes from prog_address into replyBuffer */
+static uchar checksum(uchar type, unsigned long nbytes) {
+
+	uchar state = memoryReadState(type);
+	uchar buffer[8];
+	uchar i, n;
+	unsigned long crc = 0;
+
+	if (state == PROG_STATE_IDLE) {
+		return 0;
+	}
+
+#ifdef PROG_CRC_32
+	if (type & USBASP_CRC_32) {
+		crc = 0xFFFFFFFF;
+	}
+#else
+	if (type & USBASP_CRC_32) {
+		return 0;
+	}
+#endif
+
+	while (nbytes != 0) {
+		n = (nbytes > sizeof(buffer)) ? sizeof(buffer) : nbytes;
+		readBlock(state, buffer, n);
+		for (i = 0; i < n; i++) {
+#ifdef PROG_CRC_32
+			if (type & USBASP_CRC_32) {
+				crc = crc32Update(crc, buffer[i]);
+				continue;
+			}
+#endif
+			crc = _crc_xmodem_update(crc, buffer[i]);
+		}
+		nbytes -= n;
+	}
+
+#ifdef PROG_CRC_32
+	if (type & USBASP_CRC_32) {
+		*((unsigned long*) &replyBuffer[0]) = ~crc;
+		return 4;
+	}
+#endif
+
+	replyBuffer[0] = crc;
+	replyBuffer[1] = crc >> 8;
+	return 2;
+}
+
+/* find first byte not 0xFF in nbytes from prog_address. Reply is blank
+   flag and first non-erased address (or end of range if blank) */
+static uchar blankCheck(uchar memory, unsigned long nbytes) {
+
+	uchar state = memoryReadState(memory);
+	uchar buffer[8];
+	uchar i, n;
+
+	if (state == PROG_STATE_IDLE) {
+		return 0;
+	}
+
+	replyBuffer[0] = 1;
+	while (nbytes != 0) {
+		n = (nbytes > sizeof(buffer)) ? sizeof(buffer) : nbytes;
+		readBlock(state, buffer, n);
+		for (i = 0; i < n; i++) {
+			if (buffer[i] != 0xFF) {
+				replyBuffer[0] = 0;
+				prog_address -= n - i;
+				break;
+			}
+		}
+		if (replyBuffer[0] == 0) {
+			break;
+		}
+		nbytes -= n;
+	}
+
+	*((unsigned long*) &replyBuffer[1]) = prog_address;
+	return 5;
+}
+
+#ifdef PROG_RLE_READ
+/* compress n raw bytes at prog_buffer[2] in place to the start of
+   prog_buffer, returns encoded size. Only opening a literal run makes the
+   output catch up to the input, which happens at most twice for
+   n <= PROG_BUFFER_SIZE - 2 */
+static unsigned int rleEncode(uchar n) {
+
+	uchar *in = &prog_buffer[2];
+	uchar *end = in + n;
+	uchar *out = prog_buffer;
+	uchar *control = 0;
+	uchar value;
+	uchar run;
+
+	while (in < end) {
+
+		/* count bytes equal to the current one */
+		value = *in;
+		run = 1;
+		while ((in + run < end) && (in[run] == value) && (run
+				< RLE_REPEAT_MAX)) {
+			run++;
+		}
+
+		if (run >= RLE_REPEAT_MIN) {
+			/* repeat run */
+			*out++ = 0x80 + run - RLE_REPEAT_MIN;
+			*out++ = value;
+			in += run;
+			control = 0;
+		} else {
+			/* literal, append to open literal run if possible */
+			if ((control != 0) && (*control < RLE_LITERAL_MAX - 1)) {
+				(*control)++;
+			} else {
+				control = out++;
+				*control = 0;
+			}
+			*out++ = *in++;
+		}
+	}
+
+	return out - prog_buffer;
+}
+
+/* read n bytes and encode them into prog_buffer for usbFunctionRead */
+static void readCompressed(uchar state, uchar n) {
+
+	if (n > PROG_BUFFER_SIZE - 2) {
+		n = PROG_BUFFER_SIZE - 2;
+	}
+
+	readBlock(state, &prog_buffer[2], n);
+	prog_nbytes = rleEncode(n);
+	prog_bufferpos = 0;
+	prog_state = PROG_STATE_READBUFFER;
+}
+#endif
+
+/* report event on interrupt-in endpoint, replaces an unsent one */
+static void postEvent(uchar event, uchar status, unsigned int counter) {
+
+	prog_event[0] = event;
+	prog_event[1] = status;
+	prog_event[2] = counter;
+	prog_event[3] = counter >> 8;
+	prog_eventpending = 1;
+}
+
+#ifdef ISP_GANG
+/* verify page on each selected gang target alone, select all again */
+static void verifyGang(unsigned long address) {
+
+	uchar selected = isp_gangsel;
+	uchar target;
+	unsigned int pos = prog_bufferpos;
+	unsigned int errors;
+
+	for (target = 0x01; target & ISP_GANG_MASK; target <<= 1) {
+		if (selected & target) {
+			errors = prog_verify_errors;
+			prog_bufferpos = pos;
+			if (ispGangEnter(target) != 0) {
+				prog_gangerrors |= target;
+			} else {
+				verifyPage(address);
+				if (prog_verify_errors != errors) {
+					prog_gangerrors |= target;
+				}
+			}
+		}
+	}
+
+	prog_bufferpos = 0;
+	ispGangEnter(selected);
+}
+#endif
+
+/* commit page of given address, verify it if requested */
+static void flushPage(unsigned long address, uchar pollvalue) {
+
+	unsigned int errors = prog_verify_errors;
+#ifdef ISP_GANG
+	uchar gangerrors = prog_gangerrors;
+#endif
+	uchar status;
+
+	if (prog_state == PROG_STATE_WRITEFLASH) {
+		status = ispFlushPage(address, pollvalue);
+	} else {
+		status = ispFlushEEPROMPage(address, pollvalue);
+	}
+
+	if (isp_options & USBASP_OPT_VERIFY) {
+#ifdef ISP_GANG
+		if (ispGangBroadcast()) {
+			verifyGang(address);
+			if (prog_gangerrors != gangerrors) {
+				status |= USBASP_EVENT_MISMATCH;
+			}
+		} else
+#endif
+		verifyPage(address);
+		if (prog_verify_errors != errors) {
+			status |= USBASP_EVENT_MISMATCH;
+		}
+	}
+
+#ifdef PROG_STREAM
+	prog_streamstatus |= status;
+#endif
+	postEvent(USBASP_EVENT_PAGE, status, ++prog_pages);
+}
+
+/* program byte at prog_address and advance to next address */
+static void writeByte(uchar value) {
+
+	if (prog_pagesize == 0) {
+		/* not paged */
+		uchar status;
+
+		if (prog_state == PROG_STATE_WRITEFLASH) {
+			status = ispWriteFlash(prog_address, value, 1);
+		} else {
+			status = ispWriteEEPROM(prog_address, value);
+		}
+
+		if (status != 0) {
+			countError(prog_address);
+			postEvent(USBASP_EVENT_BYTE, USBASP_EVENT_TIMEOUT, prog_address);
+		}
+
+	} else {
+		/* paged */
+
+		if (prog_state == PROG_STATE_WRITEFLASH) {
+			ispWriteFlash(prog_address, value, 0);
+		} else {
+			ispLoadEEPROMPage(prog_address, value);
+		}
+
+		/* keep a copy of the page for verify */
+		if (isp_options & USBASP_OPT_VERIFY) {
+			if (prog_bufferpos < PROG_BUFFER_SIZE) {
+				prog_buffer[prog_bufferpos] = value;
+			}
+			prog_bufferpos++;
+		}
+
+		prog_pagecounter--;
+		if (prog_pagecounter == 0) {
+			flushPage(prog_address, value);
+			prog_pagecounter = prog_pagesize;
+		}
+	}
+
+	prog_lastvalue = value;
+	prog_address++;
+}
+
+/* load run of flash bytes into page buffer at prog_address, commit page
+   if it is full. run must not cross the page end */
+static void writeBlock(uchar *data, uchar len) {
+
+	uchar i;
+
+	ispLoadFlashPage(prog_address, data, len);
+
+	/* keep a copy of the page for verify */
+	if (isp_options & USBASP_OPT_VERIFY) {
+		for (i = 0; i < len; i++) {
+			if (prog_bufferpos < PROG_BUFFER_SIZE) {
+				prog_buffer[prog_bufferpos] = data[i];
+			}
+			prog_bufferpos++;
+		}
+	}
+
+	prog_lastvalue = data[len - 1];
+	prog_address += len;
+
+	prog_pagecounter -= len;
+	if (prog_pagecounter == 0) {
+		flushPage(prog_address - 1, prog_lastvalue);
+		prog_pagecounter = prog_pagesize;
+	}
+}
+
+#ifdef PROG_LZ_WRITE
+/* write decoded byte to target and into back-reference window */
+static void lzOutput(uchar value) {
+
+	lz_window[lz_pos++ & (LZ_WINDOW_SIZE - 1)] = value;
+	writeByte(value);
+}
+
+/* decode next byte of USBASP_OPT_LZ_WRITE stream */
+static void lzDecode(uchar value) {
+
+	uchar src;
+
+	switch (lz_state) {
+
+	case LZ_STATE_CONTROL:
+		if (value < LZ_TOKEN_REPEAT) {
+			lz_count = value + 1;
+			lz_state = LZ_STATE_LITERAL;
+		} else {
+			lz_count = (value & LZ_COUNT_MASK) + LZ_COUNT_MIN;
+			if (value >= LZ_TOKEN_MATCH) {
+				lz_state = LZ_STATE_MATCH;
+			} else {
+				lz_state = LZ_STATE_REPEAT;
+			}
+		}
+		break;
+
+	case LZ_STATE_LITERAL:
+		lzOutput(value);
+		if (--lz_count == 0) {
+			lz_state = LZ_STATE_CONTROL;
+		}
+		break;
+
+	case LZ_STATE_REPEAT:
+		while (lz_count--) {
+			lzOutput(value);
+		}
+		lz_state = LZ_STATE_CONTROL;
+		break;
+
+	case LZ_STATE_MATCH:
+		/* value is distance - 1 */
+		src = lz_pos - value - 1;
+		while (lz_count--) {
+			lzOutput(lz_window[src++ & (LZ_WINDOW_SIZE - 1)]);
+		}
+		lz_state = LZ_STATE_CONTROL;
+		break;
+	}
+}
+#endif
+
+/* fastest SCK option for the target clock we generate. SCK high and low
+   have to last more than 2 target clocks, so an eighth of it */
+static uchar targetClockSCK(uchar option) {
+
+	uchar fastest = USBASP_ISP_SCK_187_5;
+
+	if (prog_targetclock == 2) {
+		fastest = USBASP_ISP_SCK_750; /* F_CPU / 16 */
+	} else if (prog_targetclock == 4) {
+		fastest = USBASP_ISP_SCK_375;
+	}
+
+	if ((option == USBASP_ISP_SCK_AUTO) || (option > fastest)) {
+		return fastest;
+	}
+	return option;
+}
+
 uchar usbFunctionSetup(uchar data[8]) {
 
 	uchar len = 0;
+	unsigned int ticks;
+
+	/* drop read ahead data of an aborted transfer */
+	if (prog_prefetchlen != 0) {
+		prog_address -= prog_prefetchlen;
+		prog_prefetchlen = 0;
+	}
+#ifdef PROG_STREAM
+	/* stream ended before all bytes arrived, tell the host */
+	if (prog_stream && (prog_nbytes != 0)) {
+		postEvent(USBASP_EVENT_STREAM, prog_streamstatus
+				| USBASP_EVENT_ABORTED, prog_nbytes);
+		prog_state = PROG_STATE_IDLE;
+	}
+	prog_stream = 0;
+#endif
 
 	if (data[1] == USBASP_FUNC_CONNECT) {
 
 		/* set SCK speed */
-		if ((SLOW_SCK_PIN & (1 << SLOW_SCK_NUM)) == 0) {
+		if (prog_targetclock != 0) {
+			ispSetSCKOption(targetClockSCK(prog_sck));
+		} else if ((SLOW_SCK_PIN & (1 << SLOW_SCK_NUM)) == 0) {
 			ispSetSCKOption(USBASP_ISP_SCK_8);
+#ifdef ISP_USART_SPI
+		} else if (prog_sckdivider != 0) {
+			ispSetSCKDivider(prog_sckdivider);
+#endif
 		} else {
 			ispSetSCKOption(prog_sck);
 		}
@@ -54,6 +621,10 @@ uchar usbFunctionSetup(uchar data[8]) {
 		/* set compatibility mode of address delivering */
 		prog_address_newmode = 0;
 
+		/* session options have to be set again after connect */
+		isp_options = 0;
+		prog_pages = 0;
+
 		ledRedOn();
 		ispConnect();
 
@@ -62,12 +633,21 @@ uchar usbFunctionSetup(uchar data[8]) {
 		ledRedOff();
 
 	} else if (data[1] == USBASP_FUNC_TRANSMIT) {
-		replyBuffer[0] = ispTransmit(data[2]);
-		replyBuffer[1] = ispTransmit(data[3]);
-		replyBuffer[2] = ispTransmit(data[4]);
-		replyBuffer[3] = ispTransmit(data[5]);
+		replyBuffer[0] = data[2];
+		replyBuffer[1] = data[3];
+		replyBuffer[2] = data[4];
+		replyBuffer[3] = data[5];
+		ispTransmitBlock(replyBuffer, 4);
 		len = 4;
 
+	} else if (ispGangBroadcast() && ((data[1] == USBASP_FUNC_READFLASH)
+			|| (data[1] == USBASP_FUNC_READEEPROM) || (data[1]
+			== USBASP_FUNC_CRC) || (data[1] == USBASP_FUNC_BLANKCHECK)
+			|| (data[1] == USBASP_FUNC_IDENTITY))) {
+
+		/* all selected gang targets drive MISO, nothing to read */
+		prog_state = PROG_STATE_IDLE;
+
 	} else if (data[1] == USBASP_FUNC_READFLASH) {
 
 		if (!prog_address_newmode)
@@ -75,6 +655,11 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_READFLASH;
+#ifdef PROG_RLE_READ
+		if (isp_options & USBASP_OPT_RLE_READ) {
+			readCompressed(prog_state, data[4]);
+		}
+#endif
 		len = 0xff; /* multiple in */
 
 	} else if (data[1] == USBASP_FUNC_READEEPROM) {
@@ -84,15 +669,56 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_READEEPROM;
+#ifdef PROG_RLE_READ
+		if (isp_options & USBASP_OPT_RLE_READ) {
+			readCompressed(prog_state, data[4]);
+		}
+#endif
 		len = 0xff; /* multiple in */
 
 	} else if (data[1] == USBASP_FUNC_ENABLEPROG) {
-		replyBuffer[0] = ispEnterProgrammingMode();
 		len = 1;
+#ifdef ISP_GANG
+		if (isp_gang != 0x01) {
+			/* gang: all targets have to answer, which did is told by
+			   USBASP_FUNC_GANG_STATUS */
+			replyBuffer[0] = (ispGangSelect(isp_gang) != isp_gang);
+			prog_gangerrors = 0;
+		} else
+#endif
+		if ((prog_sck == USBASP_ISP_SCK_AUTO) && (isp_sck
+				!= USBASP_ISP_SCK_AUTO) && (SLOW_SCK_PIN & (1
+				<< SLOW_SCK_NUM)) && (prog_targetclock == 0)) {
+			/* find fastest SCK the target accepts (isp_sck is
+			   USBASP_ISP_SCK_AUTO if an SCK divider is set). F_CPU/2 is
+			   above a quarter of any target clock, host request only */
+			replyBuffer[0] = ispEnterProgrammingModeAuto(
+					USBASP_ISP_SCK_FCPU_4, USBASP_ISP_SCK_8);
+			/* stable signature reads don't tell SCK is below a quarter
+			   of the target clock, so keep a step of margin */
+			if ((replyBuffer[0] == 0) && (isp_sck > USBASP_ISP_SCK_8)) {
+				replyBuffer[0] = ispEnterProgrammingModeAuto(isp_sck - 1,
+						USBASP_ISP_SCK_8);
+			}
+		} else if (isp_sck > USBASP_ISP_SCK_1500) {
+			/* high speed SCK only if signature reads back, else step down */
+			replyBuffer[0] = ispEnterProgrammingModeAuto(isp_sck,
+					USBASP_ISP_SCK_1500);
+		} else {
+			replyBuffer[0] = ispEnterProgrammingMode();
+		}
 
-	} else if (data[1] == USBASP_FUNC_WRITEFLASH) {
+#ifndef PROG_STREAM
+	} else if (data[1] == USBASP_FUNC_STREAMFLASH) {
 
-		if (!prog_address_newmode)
+		/* not built in, no data stage follows */
+		prog_state = PROG_STATE_IDLE;
+#endif
+
+	} else if ((data[1] == USBASP_FUNC_WRITEFLASH) || (data[1]
+			== USBASP_FUNC_STREAMFLASH)) {
+
+		if (!prog_address_newmode && (data[1] == USBASP_FUNC_WRITEFLASH))
 			prog_address = (data[3] << 8) | data[2];
 
 		prog_pagesize = data[4];
@@ -100,18 +726,52 @@ uchar usbFunctionSetup(uchar data[8]) {
 		prog_pagesize += (((unsigned int) data[5] & 0xF0) << 4);
 		if (prog_blockflags & PROG_BLOCKFLAG_FIRST) {
 			prog_pagecounter = prog_pagesize;
+			prog_bufferpos = 0;
+#ifdef PROG_LZ_WRITE
+			lz_state = LZ_STATE_CONTROL;
+			lz_pos = 0;
+#endif
 		}
+#ifdef PROG_LZ_WRITE
+		/* with LZ mode data length is the encoded size */
+		prog_lzmode = isp_options & USBASP_OPT_LZ_WRITE;
+#endif
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_WRITEFLASH;
 		len = 0xff; /* multiple out */
 
+#ifdef PROG_STREAM
+		if (data[1] == USBASP_FUNC_STREAMFLASH) {
+			/* no data stage, data comes on interrupt-out endpoint. The
+			   host may have reset the data toggle (clear halt) */
+			prog_nbytes = (data[3] << 8) | data[2];
+			prog_stream = 1;
+			prog_streamtoken = 0;
+			prog_streamstatus = 0;
+			len = 0;
+		}
+#endif
+
 	} else if (data[1] == USBASP_FUNC_WRITEEEPROM) {
 
 		if (!prog_address_newmode)
 			prog_address = (data[3] << 8) | data[2];
 
-		prog_pagesize = 0;
-		prog_blockflags = 0;
+		if (isp_options & USBASP_OPT_EEPROM_PAGED) {
+			prog_pagesize = data[4];
+			prog_blockflags = data[5] & 0x0F;
+			prog_pagesize += (((unsigned int) data[5] & 0xF0) << 4);
+			if (prog_blockflags & PROG_BLOCKFLAG_FIRST) {
+				prog_pagecounter = prog_pagesize;
+				prog_bufferpos = 0;
+			}
+		} else {
+			prog_pagesize = 0;
+			prog_blockflags = 0;
+		}
+#ifdef PROG_LZ_WRITE
+		prog_lzmode = 0;
+#endif
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_WRITEEEPROM;
 		len = 0xff; /* multiple out */
@@ -127,9 +787,179 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 		/* set sck option */
 		prog_sck = data[2];
+#ifdef ISP_USART_SPI
+		prog_sckdivider = 0;
+#endif
 		replyBuffer[0] = 0;
 		len = 1;
 
+	} else if (data[1] == USBASP_FUNC_SETSCKDIVIDER) {
+
+		/* SCK between the options, USART only */
+		replyBuffer[0] = 1;
+#ifdef ISP_USART_SPI
+		if (!(data[2] & 1) && (((data[3] << 8) | data[2]) <= 8192)) {
+			prog_sckdivider = (data[3] << 8) | data[2];
+			replyBuffer[0] = 0;
+		}
+#endif
+		len = 1;
+
+	} else if (data[1] == USBASP_FUNC_SETOPTIONS) {
+
+		/* set session options, reply with the accepted ones */
+		isp_options = data[2] & USBASP_OPT_SUPPORTED;
+#ifndef PROG_RLE_READ
+		isp_options &= ~USBASP_OPT_RLE_READ;
+#endif
+#ifndef PROG_LZ_WRITE
+		isp_options &= ~USBASP_OPT_LZ_WRITE;
+#endif
+		replyBuffer[0] = isp_options;
+		len = 1;
+
+		/* start new verify session */
+		prog_verify_errors = 0;
+		prog_bufferpos = 0;
+
+	} else if (data[1] == USBASP_FUNC_GETVERIFYSTATUS) {
+
+		/* first failed address (little endian) and count of mismatching
+		   bytes and failed byte writes */
+		*((unsigned long*) &replyBuffer[0]) = prog_verify_address;
+		replyBuffer[4] = prog_verify_errors;
+		replyBuffer[5] = prog_verify_errors >> 8;
+		len = 6;
+
+	} else if (data[1] == USBASP_FUNC_CRC) {
+
+		/* checksum of range starting at address set by SETLONGADDRESS */
+		len = checksum(data[2], ((unsigned long) data[3] << 16)
+				| ((unsigned int) data[5] << 8) | data[4]);
+
+	} else if (data[1] == USBASP_FUNC_BLANKCHECK) {
+
+		/* blank check of range starting at address set by SETLONGADDRESS */
+		len = blankCheck(data[2], ((unsigned long) data[3] << 16)
+				| ((unsigned int) data[5] << 8) | data[4]);
+
+	} else if (data[1] == USBASP_FUNC_GETISPSCK) {
+
+		/* SCK option in use, chosen one after auto detection */
+		replyBuffer[0] = isp_sck;
+		len = 1;
+
+#ifdef ISP_SCRIPT
+	} else if (data[1] == USBASP_FUNC_SCRIPT) {
+
+		/* receive script into prog_buffer, it runs when complete */
+		prog_nbytes = (data[7] << 8) | data[6];
+		prog_bufferpos = 0;
+		prog_resultlen = 0;
+		if ((prog_nbytes != 0) && (prog_nbytes < PROG_BUFFER_SIZE)) {
+			prog_state = PROG_STATE_WRITESCRIPT;
+			len = 0xff; /* multiple out */
+		}
+
+	} else if (data[1] == USBASP_FUNC_TRANSMITBATCH) {
+
+		/* instructions are sent in place, answers start at prog_buffer */
+		prog_nbytes = (data[7] << 8) | data[6];
+		prog_bufferpos = 0;
+		prog_scriptlen = 0;
+		prog_resultlen = 0;
+		if ((prog_nbytes != 0) && (prog_nbytes < PROG_BUFFER_SIZE)
+				&& ((prog_nbytes & 3) == 0)) {
+			prog_state = PROG_STATE_TRANSMITBATCH;
+			len = 0xff; /* multiple out */
+		}
+
+	} else if ((data[1] == USBASP_FUNC_SCRIPTRESULT) || (data[1]
+			== USBASP_FUNC_TRANSMITRESULT)) {
+
+		/* status and captured bytes of last script or answers of last
+		   instruction batch */
+		prog_bufferpos = prog_scriptlen;
+		prog_nbytes = prog_scriptlen + prog_resultlen;
+		prog_state = PROG_STATE_READBUFFER;
+		len = 0xff; /* multiple in */
+#endif
+
+	} else if (data[1] == USBASP_FUNC_CHIPERASE) {
+
+		/* erase and wait for the target instead of a worst case delay */
+		ticks = (data[3] << 8) | data[2];
+		if (ticks == 0) {
+			ticks = USBASP_ERASE_TIMEOUT;
+		}
+		replyBuffer[0] = ispChipErase(ticks, &ticks);
+		replyBuffer[1] = ticks;
+		replyBuffer[2] = ticks >> 8;
+		len = 3;
+		postEvent(USBASP_EVENT_ERASE, replyBuffer[0], ticks);
+
+#ifdef ISP_GANG
+	} else if (data[1] == USBASP_FUNC_GANG_SETUP) {
+
+		/* targets used from next connect on. RST is an output while
+		   connected: ispDisconnect() has to release the same mask */
+		if (!(ISP_DDR & (1 << ISP_RST))) {
+			isp_gang = data[2] & ISP_GANG_MASK;
+			if (isp_gang == 0) {
+				isp_gang = 0x01;
+			}
+		}
+		replyBuffer[0] = isp_gang;
+		len = 1;
+
+	} else if (data[1] == USBASP_FUNC_GANG_SELECT) {
+
+		replyBuffer[0] = ispGangSelect(data[2]);
+		prog_gangerrors = 0;
+		len = 1;
+
+	} else if (data[1] == USBASP_FUNC_GANG_STATUS) {
+
+		replyBuffer[0] = isp_gang;
+		replyBuffer[1] = isp_gangsel;
+		replyBuffer[2] = prog_gangerrors;
+		len = 3;
+#endif
+
+	} else if (data[1] == USBASP_FUNC_SETTARGETCLOCK) {
+
+		/* clock fuse-misconfigured or slow targets from us */
+		replyBuffer[0] = 1;
+		if ((data[2] == 0) || (data[2] == 2) || (data[2] == 4)
+				|| (data[2] == 8)) {
+			replyBuffer[0] = clockTargetOutput(data[2]);
+			if (replyBuffer[0] == 0) {
+				prog_targetclock = data[2];
+			}
+		}
+		replyBuffer[1] = prog_targetclock ? targetClockSCK(prog_sck)
+				: prog_sck;
+		len = 2;
+
+	} else if (data[1] == USBASP_FUNC_IDENTITY) {
+
+		/* signature, fuses, lock and calibration bytes in one reply */
+		if ((data[2] & USBASP_MEM_MASK) == USBASP_MEM_TPI) {
+			for (len = 0; len < USBASP_IDENT_SIZE; len++) {
+				replyBuffer[len] = 0xFF;
+			}
+			tpi_read_block(TPI_ADDR_SIGNATURE,
+					&replyBuffer[USBASP_IDENT_SIGNATURE], 3);
+			tpi_read_block(TPI_ADDR_CONFIG, &replyBuffer[USBASP_IDENT_LFUSE],
+					1);
+			tpi_read_block(TPI_ADDR_LOCK, &replyBuffer[USBASP_IDENT_LOCK], 1);
+			tpi_read_block(TPI_ADDR_CALIBRATION,
+					&replyBuffer[USBASP_IDENT_CALIBRATION], 1);
+		} else {
+			ispReadIdentity(replyBuffer);
+		}
+		len = USBASP_IDENT_SIZE;
+
 	} else if (data[1] == USBASP_FUNC_TPI_CONNECT) {
 		tpi_dly_cnt = data[2] | (data[3] << 8);
 
@@ -186,9 +1016,33 @@ uchar usbFunctionSetup(uchar data[8]) {
 		len = 0xff; /* multiple out */
 
 	} else if (data[1] == USBASP_FUNC_GETCAPABILITIES) {
-		replyBuffer[0] = USBASP_CAP_0_TPI;
-		replyBuffer[1] = 0;
+		replyBuffer[0] = USBASP_CAP_0_TPI | USBASP_CAP_0_OPTIONS
+				| USBASP_CAP_0_VERIFY | USBASP_CAP_0_CRC
+				| USBASP_CAP_0_BLANKCHECK | USBASP_CAP_0_SCK_AUTO;
+		replyBuffer[1] = USBASP_CAP_1_IDENTITY | USBASP_CAP_1_CHIPERASE
+				| USBASP_CAP_1_EVENTS;
+#ifdef PROG_RLE_READ
+		replyBuffer[0] |= USBASP_CAP_0_RLE_READ;
+#endif
+#ifdef PROG_LZ_WRITE
+		replyBuffer[0] |= USBASP_CAP_0_LZ_WRITE;
+#endif
+#ifdef ISP_SCRIPT
+		replyBuffer[1] |= USBASP_CAP_1_SCRIPT | USBASP_CAP_1_TRANSMITBATCH;
+#endif
+#ifdef ISP_GANG
+		replyBuffer[1] |= USBASP_CAP_1_GANG;
+#endif
+#ifdef PROG_STREAM
+		replyBuffer[1] |= USBASP_CAP_1_STREAM_WRITE;
+#endif
+#ifdef CLOCK_TARGET_BIT
+		replyBuffer[1] |= USBASP_CAP_1_TARGETCLOCK;
+#endif
 		replyBuffer[2] = 0;
+#ifdef ISP_USART_SPI
+		replyBuffer[2] |= USBASP_CAP_2_SCK_DIVIDER;
+#endif
 		replyBuffer[3] = 0;
 		len = 4;
 	}
@@ -204,26 +1058,39 @@ uchar usbFunctionRead(uchar *data, uchar len) {
 
 	/* check if programmer is in correct read state */
 	if ((prog_state != PROG_STATE_READFLASH) && (prog_state
-			!= PROG_STATE_READEEPROM) && (prog_state != PROG_STATE_TPI_READ)) {
+			!= PROG_STATE_READEEPROM) && (prog_state != PROG_STATE_TPI_READ)
+			&& (prog_state != PROG_STATE_READBUFFER)) {
 		return 0xff;
 	}
 
-	/* fill packet TPI mode */
-	if(prog_state == PROG_STATE_TPI_READ)
-	{
-		tpi_read_block(prog_address, data, len);
-		prog_address += len;
+	/* send prepared buffer, short packet ends the transfer */
+	if (prog_state == PROG_STATE_READBUFFER) {
+		if (len > prog_nbytes - prog_bufferpos) {
+			len = prog_nbytes - prog_bufferpos;
+		}
+		for (i = 0; i < len; i++) {
+			data[i] = prog_buffer[prog_bufferpos++];
+		}
+		if (len < 8) {
+			prog_state = PROG_STATE_IDLE;
+		}
 		return len;
 	}
 
-	/* fill packet ISP mode */
-	for (i = 0; i < len; i++) {
-		if (prog_state == PROG_STATE_READFLASH) {
-			data[i] = ispReadFlash(prog_address);
-		} else {
-			data[i] = ispReadEEPROM(prog_address);
+	/* fill packet, from read ahead buffer if available */
+	if (prog_prefetchlen != 0) {
+		for (i = 0; i < len; i++) {
+			data[i] = prog_prefetch[i];
 		}
-		prog_address++;
+		prog_prefetchlen = 0;
+	} else {
+		readBlock(prog_state, data, len);
+		prog_nbytes -= len;
+	}
+
+	/* TPI reads don't track the last packet */
+	if (prog_state == PROG_STATE_TPI_READ) {
+		return len;
 	}
 
 	/* last packet? */
@@ -237,14 +1104,52 @@ uchar usbFunctionRead(uchar *data, uchar len) {
 uchar usbFunctionWrite(uchar *data, uchar len) {
 
 	uchar retVal = 0;
-	uchar i;
+	uchar i, n;
 
 	/* check if programmer is in correct write state */
 	if ((prog_state != PROG_STATE_WRITEFLASH) && (prog_state
-			!= PROG_STATE_WRITEEEPROM) && (prog_state != PROG_STATE_TPI_WRITE)) {
+			!= PROG_STATE_WRITEEEPROM) && (prog_state != PROG_STATE_TPI_WRITE)
+			&& (prog_state != PROG_STATE_WRITESCRIPT) && (prog_state
+			!= PROG_STATE_TRANSMITBATCH)) {
 		return 0xff;
 	}
 
+#ifdef ISP_SCRIPT
+	if (prog_state == PROG_STATE_TRANSMITBATCH) {
+		for (i = 0; i < len; i++) {
+			prog_buffer[prog_bufferpos + i] = data[i];
+		}
+		ispTransmitBlock(&prog_buffer[prog_bufferpos], len);
+		prog_bufferpos += len;
+		prog_nbytes -= len;
+		if (prog_nbytes == 0) {
+			prog_resultlen = prog_bufferpos;
+			prog_state = PROG_STATE_IDLE;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (prog_state == PROG_STATE_WRITESCRIPT) {
+		for (i = 0; i < len; i++) {
+			prog_buffer[prog_bufferpos++] = data[i];
+		}
+		prog_nbytes -= len;
+		if (prog_nbytes == 0) {
+			/* whole script received, run it */
+			prog_scriptlen = prog_bufferpos;
+			prog_resultlen = ispRunScript(prog_buffer, prog_scriptlen,
+					&prog_buffer[prog_scriptlen], PROG_BUFFER_SIZE
+							- prog_scriptlen);
+			postEvent(USBASP_EVENT_SCRIPT, prog_buffer[prog_scriptlen],
+					prog_resultlen);
+			prog_state = PROG_STATE_IDLE;
+			return 1;
+		}
+		return 0;
+	}
+#endif
+
 	if (prog_state == PROG_STATE_TPI_WRITE)
 	{
 		tpi_write_block(prog_address, data, len);
@@ -258,49 +1163,70 @@ uchar usbFunctionWrite(uchar *data, uchar len) {
 		return 0;
 	}
 
-	for (i = 0; i < len; i++) {
-
-		if (prog_state == PROG_STATE_WRITEFLASH) {
-			/* Flash */
-
-			if (prog_pagesize == 0) {
-				/* not paged */
-				ispWriteFlash(prog_address, data[i], 1);
-			} else {
-				/* paged */
-				ispWriteFlash(prog_address, data[i], 0);
-				prog_pagecounter--;
-				if (prog_pagecounter == 0) {
-					ispFlushPage(prog_address, data[i]);
-					prog_pagecounter = prog_pagesize;
-				}
+	i = 0;
+	while (i < len) {
+
+#ifdef PROG_LZ_WRITE
+		if (prog_lzmode) {
+			lzDecode(data[i]);
+			n = 1;
+		} else
+#endif
+		if ((prog_pagesize != 0) && (prog_state
+				== PROG_STATE_WRITEFLASH)) {
+			/* paged flash: load whole run up to page end at once.
+			   page counter 0 stands for 256 byte pages */
+			n = len - i;
+			if ((prog_pagecounter != 0) && (n > prog_pagecounter)) {
+				n = prog_pagecounter;
 			}
-
+			if (n > prog_nbytes) {
+				n = prog_nbytes;
+			}
+			writeBlock(&data[i], n);
 		} else {
-			/* EEPROM */
-			ispWriteEEPROM(prog_address, data[i]);
+			writeByte(data[i]);
+			n = 1;
 		}
 
-		prog_nbytes--;
+		i += n;
+		prog_nbytes -= n;
 
 		if (prog_nbytes == 0) {
-			prog_state = PROG_STATE_IDLE;
 			if ((prog_blockflags & PROG_BLOCKFLAG_LAST) && (prog_pagecounter
 					!= prog_pagesize)) {
 
 				/* last block and page flush pending, so flush it now */
-				ispFlushPage(prog_address, data[i]);
+				flushPage(prog_address - 1, prog_lastvalue);
 			}
+			prog_state = PROG_STATE_IDLE;
 
 			retVal = 1; // Need to return 1 when no more data is to be received
+			break;
 		}
-
-		prog_address++;
 	}
 
 	return retVal;
 }
 
+#ifdef PROG_STREAM
+void usbFunctionWriteOut(uchar *data, uchar len) {
+
+	/* packet sent again because host missed our ACK */
+	if (usbCurrentDataToken == prog_streamtoken) {
+		return;
+	}
+	prog_streamtoken = usbCurrentDataToken;
+
+	/* same page loading as control transfers. The last packet is already
+	   acknowledged, the host waits for the event before its next request */
+	if (prog_stream && (usbFunctionWrite(data, len) == 1)) {
+		prog_stream = 0;
+		postEvent(USBASP_EVENT_STREAM, prog_streamstatus, 0);
+	}
+}
+#endif
+
 void hardwareInit(void) {
 
 	uchar i;
@@ -323,6 +1249,9 @@ void hardwareInit(void) {
 }
 
 void usbHadReset() {
+#ifdef PROG_STREAM
+	prog_streamtoken = 0;
+#endif
 	ledGreenOff();
 }
 
@@ -345,6 +1274,11 @@ int main(void) {
 	/* main loop */
 	for (;;) {
 		usbPoll();
+		if (prog_eventpending && usbInterruptIsReady()) {
+			usbSetInterrupt(prog_event, USBASP_EVENT_SIZE);
+			prog_eventpending = 0;
+		}
+		readAhead();
 	}
 
 	return 0;
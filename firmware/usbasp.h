@@ -28,10 +28,206 @@
 #define USBASP_FUNC_TPI_RAWWRITE     14
 #define USBASP_FUNC_TPI_READBLOCK    15
 #define USBASP_FUNC_TPI_WRITEBLOCK   16
+#define USBASP_FUNC_SETOPTIONS       17
+#define USBASP_FUNC_GETVERIFYSTATUS  18
+#define USBASP_FUNC_CRC              19
+#define USBASP_FUNC_BLANKCHECK       20
+#define USBASP_FUNC_GETISPSCK        21
+#define USBASP_FUNC_SCRIPT           22
+#define USBASP_FUNC_SCRIPTRESULT     23
+#define USBASP_FUNC_TRANSMITBATCH    24
+#define USBASP_FUNC_TRANSMITRESULT   25
+#define USBASP_FUNC_IDENTITY         26
+#define USBASP_FUNC_CHIPERASE        27
+#define USBASP_FUNC_GANG_SETUP       28
+#define USBASP_FUNC_GANG_SELECT      29
+#define USBASP_FUNC_SETTARGETCLOCK   30
+#define USBASP_FUNC_STREAMFLASH      31
+#define USBASP_FUNC_GANG_STATUS      32
+#define USBASP_FUNC_SETSCKDIVIDER    33
 #define USBASP_FUNC_GETCAPABILITIES 127
 
-/* USBASP capabilities */
+/* USBASP capabilities. RLE_READ, LZ_WRITE, SCRIPT, TRANSMITBATCH and GANG
+   are build options (see Makefile), only set if built in */
 #define USBASP_CAP_0_TPI    0x01
+#define USBASP_CAP_0_OPTIONS 0x02
+#define USBASP_CAP_0_VERIFY  0x04
+#define USBASP_CAP_0_CRC     0x08
+#define USBASP_CAP_0_BLANKCHECK 0x10
+#define USBASP_CAP_0_RLE_READ 0x20
+#define USBASP_CAP_0_LZ_WRITE 0x40
+#define USBASP_CAP_0_SCK_AUTO 0x80
+#define USBASP_CAP_1_SCRIPT  0x01
+#define USBASP_CAP_1_TRANSMITBATCH 0x02
+#define USBASP_CAP_1_IDENTITY 0x04
+#define USBASP_CAP_1_CHIPERASE 0x08
+#define USBASP_CAP_1_GANG    0x10
+#define USBASP_CAP_1_TARGETCLOCK 0x20
+#define USBASP_CAP_1_EVENTS  0x40
+#define USBASP_CAP_1_STREAM_WRITE 0x80
+#define USBASP_CAP_2_SCK_DIVIDER 0x01
+
+/* Session options (USBASP_FUNC_SETOPTIONS), cleared on connect. The reply
+   has the accepted ones, options of features not built in are dropped */
+#define USBASP_OPT_RDYBSY   0x01  /* target supports "Poll RDY/BSY" (0xF0) */
+#define USBASP_OPT_EEPROM_POLL 0x02 /* data polling on EEPROM byte writes */
+#define USBASP_OPT_EEPROM_PAGED 0x04 /* EEPROM page buffer (0xC1/0xC2) */
+#define USBASP_OPT_ERASED   0x08  /* chip is erased, skip 0xFF flash data */
+#define USBASP_OPT_VERIFY   0x10  /* read back and compare committed pages */
+#define USBASP_OPT_RLE_READ 0x20  /* run-length encoded flash/EEPROM reads */
+#define USBASP_OPT_LZ_WRITE 0x40  /* compressed flash writes, see LZ_* */
+#define USBASP_OPT_SUPPORTED (USBASP_OPT_RDYBSY | USBASP_OPT_EEPROM_POLL \
+		| USBASP_OPT_EEPROM_PAGED | USBASP_OPT_ERASED | USBASP_OPT_VERIFY \
+		| USBASP_OPT_RLE_READ | USBASP_OPT_LZ_WRITE)
+
+/* Run-length encoding of USBASP_OPT_RLE_READ streams. wIndex of the read
+   request is the number of raw bytes (max. PROG_BUFFER_SIZE - 2), wLength
+   the maximum encoded size. Control byte followed by data:
+   0x00..0x7F: control + 1 literal bytes follow
+   0x80..0xFF: next byte is repeated control - 0x80 + 3 times */
+#define RLE_LITERAL_MAX     128
+#define RLE_REPEAT_MIN      3
+#define RLE_REPEAT_MAX      130
+
+/* Encoding of USBASP_OPT_LZ_WRITE streams, wLength of the write request is
+   the encoded size. Tokens must not span blocks, the window is kept from
+   the PROG_BLOCKFLAG_FIRST block on. Control byte followed by data:
+   0x00..0x7F: control + 1 literal bytes follow
+   0x80..0xBF: next byte is repeated (control & 0x3F) + 3 times
+   0xC0..0xFF: copy (control & 0x3F) + 3 bytes from window, next byte is
+               distance - 1 (distance max. LZ_WINDOW_SIZE) */
+#define LZ_WINDOW_SIZE      64  /* power of 2 */
+#define LZ_TOKEN_REPEAT     0x80
+#define LZ_TOKEN_MATCH      0xC0
+#define LZ_COUNT_MASK       0x3F
+#define LZ_COUNT_MIN        3
+
+/* LZ decoder state */
+#define LZ_STATE_CONTROL    0
+#define LZ_STATE_LITERAL    1
+#define LZ_STATE_REPEAT     2
+#define LZ_STATE_MATCH      3
+
+/* ISP script (USBASP_FUNC_SCRIPT), wLength is the script size (max.
+   PROG_BUFFER_SIZE - 1). The script runs when it is received completely,
+   USBASP_FUNC_SCRIPTRESULT returns status and captured bytes. Opcode
+   followed by operands: */
+#define USBASP_SCRIPT_END       0x00  /* end of script */
+#define USBASP_SCRIPT_SEND      0x01  /* b0 b1 b2 b3: send instruction */
+#define USBASP_SCRIPT_CAPTURE   0x02  /* b0 b1 b2 b3: send, capture 4th byte */
+#define USBASP_SCRIPT_WAIT      0x03  /* n: wait n * 320us */
+#define USBASP_SCRIPT_POLL      0x04  /* b0 b1 b2 b3 mask value timeout:
+                                         send until (4th byte & mask) == value,
+                                         timeout in 320us units */
+#define USBASP_SCRIPT_READRANGE 0x05  /* b0 ahi alo n: capture b0 ahi alo 0
+                                         for n consecutive addresses */
+
+/* Batched raw ISP instructions (USBASP_FUNC_TRANSMITBATCH), wLength is
+   a multiple of 4 (max. PROG_BUFFER_SIZE - 4). Instructions are sent back to
+   back as they arrive, USBASP_FUNC_TRANSMITRESULT returns the answers.
+   Use a script if the target needs delays between instructions. */
+
+/* ISP script status, first byte of USBASP_FUNC_SCRIPTRESULT reply */
+#define USBASP_SCRIPT_OK        0
+#define USBASP_SCRIPT_TIMEOUT   1  /* poll timed out, script aborted */
+#define USBASP_SCRIPT_INVALID   2  /* unknown opcode or truncated script */
+#define USBASP_SCRIPT_FULL      3  /* no room for more captured bytes */
+
+/* Streamed flash write (USBASP_FUNC_STREAMFLASH, STREAM=1 builds): setup
+   like USBASP_FUNC_WRITEFLASH, but without data stage and wValue is the
+   number of bytes. The address has to be set by USBASP_FUNC_SETLONGADDRESS.
+   Data follows on interrupt-out endpoint 1, starting with either data
+   toggle. The last packet is acknowledged before its page is committed and
+   verified, so the host has to wait for USBASP_EVENT_STREAM before its next
+   request. A request before ends the stream, the loaded data is dropped.
+   Low speed interrupt endpoints move 8 bytes per polling interval (10 ms),
+   so this is limited to 800 bytes/s, see tools/usbasp-bench */
+
+/* Events on interrupt-in endpoint 1: event, status, counter (little
+   endian). An event not fetched by the host yet is replaced by the next */
+#define USBASP_EVENT_SIZE   4
+#define USBASP_EVENT_PAGE   1  /* page committed, counter: pages since connect */
+#define USBASP_EVENT_ERASE  2  /* chip erase done, counter: time in 320us */
+#define USBASP_EVENT_SCRIPT 3  /* script done, status: USBASP_SCRIPT_*,
+                                  counter: result size */
+#define USBASP_EVENT_STREAM 4  /* stream ended, status: bits of its pages,
+                                  USBASP_EVENT_ABORTED if cut short,
+                                  counter: bytes missing */
+#define USBASP_EVENT_BYTE   5  /* byte write (not paged) failed,
+                                  counter: address bits 0..15 */
+
+/* Status bits of USBASP_EVENT_PAGE, USBASP_EVENT_ERASE,
+   USBASP_EVENT_STREAM and USBASP_EVENT_BYTE */
+#define USBASP_EVENT_TIMEOUT  0x01  /* target didn't get ready */
+#define USBASP_EVENT_MISMATCH 0x02  /* verify of page failed */
+#define USBASP_EVENT_ABORTED  0x04  /* data of USBASP_EVENT_STREAM dropped */
+
+/* Range requests (USBASP_FUNC_CRC, USBASP_FUNC_BLANKCHECK) start at the
+   address set by USBASP_FUNC_SETLONGADDRESS. wValue low byte is the memory
+   selector (and type), wValue high byte bits 16..23 and wIndex bits 0..15
+   of the length in bytes. An invalid selector gives an empty reply, so
+   does USBASP_CRC_32 in builds without CRC_32=1.
+   USBASP_FUNC_CRC replies the CRC-16 (2 bytes) or CRC-32 (4 bytes), little
+   endian. USBASP_FUNC_BLANKCHECK replies 5 bytes: blank flag (1 if every
+   byte is 0xFF) and the 32-bit address (little endian) of the first byte
+   that isn't 0xFF, or the end of the range if blank */
+#define USBASP_MEM_FLASH    1
+#define USBASP_MEM_EEPROM   2
+#define USBASP_MEM_TPI      3
+#define USBASP_MEM_MASK     0x03
+
+/* Checksum type: CRC-32 (IEEE 802.3) if set, else CRC-16 (XMODEM) */
+#define USBASP_CRC_32       0x80
+
+/* Target identity block (USBASP_FUNC_IDENTITY), wValue is the memory
+   selector (USBASP_MEM_TPI for TPI targets, ISP otherwise). TPI targets
+   report their configuration byte as low fuse and one calibration byte,
+   missing entries read 0xFF */
+#define USBASP_IDENT_SIGNATURE   0  /* 3 bytes */
+#define USBASP_IDENT_LFUSE       3
+#define USBASP_IDENT_HFUSE       4
+#define USBASP_IDENT_EFUSE       5
+#define USBASP_IDENT_LOCK        6
+#define USBASP_IDENT_CALIBRATION 7  /* 4 bytes */
+#define USBASP_IDENT_SIZE        11
+
+/* Chip erase (USBASP_FUNC_CHIPERASE), wValue is the timeout in 320us
+   units, 0 for default. Reply is status (0 done, 1 timeout) and elapsed
+   time in 320us units (little endian). Without USBASP_OPT_RDYBSY the
+   signature is polled after the minimum erase time of 9 ms, so the
+   elapsed time is at least that; with RDY/BSY it is the measured time */
+#define USBASP_ERASE_TIMEOUT 313  /* 100 ms */
+
+/* Gang programming, targets share SCK/MOSI/MISO and have own reset lines:
+   target 0 on RST (PB2), targets 1..3 on PC3..PC5. USBASP_FUNC_GANG_SETUP
+   sets the target mask in wValue and replies it. It is ignored while
+   connected, the reply is the unchanged mask then.
+   ENABLEPROG enters all of them, its status is 0 only if every target
+   answered. Writes go to all selected targets with fixed delays instead of
+   polling, USBASP_OPT_VERIFY checks each page on every target one by one.
+   Reads, CRC, blank check and identity are refused (empty reply) while
+   several targets are selected. USBASP_FUNC_GANG_SELECT re-enters the
+   targets of mask wValue and selects them, a single one for reads, and
+   replies the selected mask. USBASP_FUNC_GANG_STATUS replies target mask,
+   selected mask and mask of targets with verify errors or lost programming
+   mode since last ENABLEPROG/GANG_SELECT */
+
+/* Target clock (USBASP_FUNC_SETTARGETCLOCK), wValue is the divider of
+   F_CPU: 2, 4, 8 or 0 for off. Set before connect, SCK is limited to an
+   eighth of the target clock then (below a quarter as ISP requires).
+   Reply is status and the SCK option used from next connect on */
+
+/* SCK divider (USBASP_FUNC_SETSCKDIVIDER, USART_SPI builds), wValue is an
+   even divider of F_CPU from 2 to 8192 for any SCK the SCK options don't
+   have, used from next connect on instead of the option. 0 goes back to
+   the option. Reply is status (0 ok, 1 invalid or not supported).
+   USBASP_FUNC_GETISPSCK replies USBASP_ISP_SCK_AUTO while it is in use */
+
+/* TPI NVM sections read for the identity block */
+#define TPI_ADDR_LOCK        0x3F00
+#define TPI_ADDR_CONFIG      0x3F40
+#define TPI_ADDR_CALIBRATION 0x3F80
+#define TPI_ADDR_SIGNATURE   0x3FC0
 
 /* programming state */
 #define PROG_STATE_IDLE         0
@@ -41,6 +237,13 @@
 #define PROG_STATE_WRITEEEPROM  4
 #define PROG_STATE_TPI_READ     5
 #define PROG_STATE_TPI_WRITE    6
+#define PROG_STATE_READBUFFER   7
+#define PROG_STATE_WRITESCRIPT  8
+#define PROG_STATE_TRANSMITBATCH 9
+
+/* Size of page copy for verify, largest flash page of supported targets.
+   Bytes of larger pages can't be checked and count as mismatches */
+#define PROG_BUFFER_SIZE        256
 
 /* Block mode flags */
 #define PROG_BLOCKFLAG_FIRST    1
@@ -60,6 +263,11 @@
 #define USBASP_ISP_SCK_375    10  /* 375 kHz   */
 #define USBASP_ISP_SCK_750    11  /* 750 kHz   */
 #define USBASP_ISP_SCK_1500   12  /* 1.5 MHz   */
+#define USBASP_ISP_SCK_2000   13  /* 2 MHz (USART SPI builds, else 1.5 MHz) */
+#define USBASP_ISP_SCK_FCPU_4 14  /* F_CPU/4: 3 MHz at 12 MHz, 4 MHz at 16 MHz */
+#define USBASP_ISP_SCK_FCPU_2 15  /* F_CPU/2: 6 MHz at 12 MHz, 8 MHz at 16 MHz,
+                                     out of spec for targets up to 20 MHz,
+                                     never chosen by auto detection */
 
 /* macros for gpio functions */
 #define ledRedOn()    PORTC &= ~(1 << PC0)
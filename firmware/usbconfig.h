@@ -59,7 +59,7 @@ the newest features and options.
 
 /* --------------------------- Functional Range ---------------------------- */
 
-#define USB_CFG_HAVE_INTRIN_ENDPOINT    0
+#define USB_CFG_HAVE_INTRIN_ENDPOINT    1
 /* Define this to 1 if you want to compile a version with two endpoints: The
  * default control endpoint 0 and an interrupt-in endpoint 1.
  */
@@ -99,10 +99,20 @@ the newest features and options.
  * data from a static buffer, set it to 0 and return the data from
  * usbFunctionSetup(). This saves a couple of bytes.
  */
+#ifdef PROG_STREAM
+#define USB_CFG_IMPLEMENT_FN_WRITEOUT   1
+#else
 #define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
+#endif
 /* Define this to 1 if you want to use interrupt-out (or bulk out) endpoint 1.
  * You must implement the function usbFunctionWriteOut() which receives all
  * interrupt/bulk data sent to endpoint 1.
+ * USBasp: STREAM=1 builds, the endpoint is declared in
+ * usbDescriptorConfiguration (main.c).
+ */
+#define USB_CFG_CHECK_DATA_TOGGLING     USB_CFG_IMPLEMENT_FN_WRITEOUT
+/* Define this to 1 if you want to filter out duplicate data packets sent by
+ * the host because it didn't get our ACK. usbFunctionWriteOut() drops them.
  */
 #define USB_CFG_HAVE_FLOWCONTROL        0
 /* Define this to 1 if you want flowcontrol over USB data. See the definition
@@ -227,7 +237,11 @@ extern void usbAddressAssigned();
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
+#ifdef PROG_STREAM
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH(32)
+#else
 #define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#endif
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
@@ -0,0 +1,285 @@
+/*
+ * usbasp-bench.c - part of USBasp
+ *
+ * Description....: Compares flash write speed of control transfers and
+ *                  interrupt-out streaming (USBASP_FUNC_STREAMFLASH)
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ *
+ * The connected target is erased and programmed with pseudo random data
+ * once per transport, every run is read back and verified.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "../../firmware/usbasp.h"
+
+#define USBASP_VID      0x16C0
+#define USBASP_PID      0x05DC
+#define USBASP_EP_OUT   0x01
+#define USBASP_EP_IN    0x81
+
+#define BLOCK_SIZE      200 /* bytes per request, as avrdude does */
+#define TIMEOUT         5000 /* ms */
+
+#define TRANSPORT_CONTROL 0
+#define TRANSPORT_STREAM  1
+
+static libusb_device_handle *handle;
+
+/* vendor request, returns transferred bytes or libusb error */
+static int request(uint8_t func, uint16_t value, uint16_t index,
+		unsigned char *buffer, uint16_t len, int in) {
+
+	return libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR
+			| LIBUSB_RECIPIENT_DEVICE | (in ? LIBUSB_ENDPOINT_IN
+			: LIBUSB_ENDPOINT_OUT), func, value, index, buffer, len, TIMEOUT);
+}
+
+static int setAddress(unsigned long address) {
+
+	unsigned char reply[4];
+
+	return request(USBASP_FUNC_SETLONGADDRESS, address & 0xFFFF,
+			address >> 16, reply, sizeof(reply), 1);
+}
+
+static double now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int erase(void) {
+
+	unsigned char reply[4];
+
+	if (request(USBASP_FUNC_CHIPERASE, 0, 0, reply, 3, 1) != 3) {
+		return -1;
+	}
+	return reply[0];
+}
+
+/* wait for end of stream, the last page is committed after the data */
+static int waitStream(void) {
+
+	unsigned char event[USBASP_EVENT_SIZE];
+	int transferred;
+
+	do {
+		if ((libusb_interrupt_transfer(handle, USBASP_EP_IN, event,
+				sizeof(event), &transferred, TIMEOUT) != 0)
+				|| (transferred != USBASP_EVENT_SIZE)) {
+			return -1;
+		}
+	} while (event[0] != USBASP_EVENT_STREAM);
+
+	return event[1];
+}
+
+static int writeFlash(int transport, unsigned char *data, unsigned long size,
+		unsigned int pagesize) {
+
+	unsigned long address;
+	unsigned int n;
+	unsigned int flags;
+	int transferred;
+	int rc;
+
+	for (address = 0; address < size; address += n) {
+
+		n = size - address;
+		if (n > BLOCK_SIZE) {
+			n = BLOCK_SIZE;
+		}
+
+		flags = 0;
+		if (address == 0) {
+			flags |= PROG_BLOCKFLAG_FIRST;
+		}
+		if (address + n == size) {
+			flags |= PROG_BLOCKFLAG_LAST;
+		}
+		flags = (pagesize & 0xFF) | (flags << 8) | ((pagesize & 0xF00) << 4);
+
+		if (setAddress(address) < 0) {
+			return -1;
+		}
+
+		if (transport == TRANSPORT_CONTROL) {
+			rc = request(USBASP_FUNC_WRITEFLASH, address & 0xFFFF, flags,
+					data + address, n, 0);
+			if (rc != (int) n) {
+				return -1;
+			}
+		} else {
+			if (request(USBASP_FUNC_STREAMFLASH, n, flags, NULL, 0, 0) < 0) {
+				return -1;
+			}
+			rc = libusb_interrupt_transfer(handle, USBASP_EP_OUT,
+					data + address, n, &transferred, TIMEOUT);
+			if ((rc != 0) || (transferred != (int) n)
+					|| (waitStream() != 0)) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int verifyFlash(unsigned char *data, unsigned long size) {
+
+	unsigned char buffer[BLOCK_SIZE];
+	unsigned long address;
+	unsigned int n;
+
+	for (address = 0; address < size; address += n) {
+
+		n = size - address;
+		if (n > BLOCK_SIZE) {
+			n = BLOCK_SIZE;
+		}
+
+		if ((setAddress(address) < 0) || (request(USBASP_FUNC_READFLASH,
+				address & 0xFFFF, 0, buffer, n, 1) != (int) n)) {
+			return -1;
+		}
+		if (memcmp(buffer, data + address, n) != 0) {
+			fprintf(stderr, "verify error in block at 0x%05lx\n", address);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int run(int transport, unsigned char *data, unsigned long size,
+		unsigned int pagesize) {
+
+	double start, elapsed;
+
+	if (erase() != 0) {
+		fprintf(stderr, "chip erase failed\n");
+		return -1;
+	}
+
+	start = now();
+	if (writeFlash(transport, data, size, pagesize) != 0) {
+		fprintf(stderr, "write failed\n");
+		return -1;
+	}
+	elapsed = now() - start;
+
+	if (verifyFlash(data, size) != 0) {
+		return -1;
+	}
+
+	printf("%-9s %6lu bytes  %7.3f s  %7.2f kB/s\n",
+			transport == TRANSPORT_CONTROL ? "control" : "interrupt", size,
+			elapsed, size / elapsed / 1024);
+
+	return 0;
+}
+
+static void usage(void) {
+
+	fprintf(stderr, "usage: usbasp-bench [-s size] [-p pagesize]\n"
+		"  size      bytes written per run (default 8192)\n"
+		"  pagesize  flash page size of the target in bytes (default 64)\n");
+}
+
+int main(int argc, char **argv) {
+
+	unsigned char caps[4];
+	unsigned char reply[4];
+	unsigned char *data;
+	unsigned long size = 8192;
+	unsigned int pagesize = 64;
+	unsigned long i;
+	int rc = 1;
+
+	for (i = 1; i < (unsigned long) argc; i++) {
+		if ((strcmp(argv[i], "-s") == 0) && (i + 1 < (unsigned long) argc)) {
+			size = strtoul(argv[++i], NULL, 0);
+		} else if ((strcmp(argv[i], "-p") == 0) && (i + 1
+				< (unsigned long) argc)) {
+			pagesize = strtoul(argv[++i], NULL, 0);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+
+	if ((size == 0) || (pagesize == 0) || (pagesize > PROG_BUFFER_SIZE)) {
+		usage();
+		return 1;
+	}
+
+	data = malloc(size);
+	if (data == NULL) {
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < size; i++) {
+		data[i] = rand();
+	}
+
+	if (libusb_init(NULL) != 0) {
+		fprintf(stderr, "libusb init failed\n");
+		return 1;
+	}
+
+	handle = libusb_open_device_with_vid_pid(NULL, USBASP_VID, USBASP_PID);
+	if (handle == NULL) {
+		fprintf(stderr, "USBasp not found\n");
+		goto exit;
+	}
+	if (libusb_claim_interface(handle, 0) != 0) {
+		fprintf(stderr, "USBasp is busy\n");
+		libusb_close(handle);
+		goto exit;
+	}
+
+	if ((request(USBASP_FUNC_GETCAPABILITIES, 0, 0, caps, 4, 1) != 4)
+			|| !(caps[1] & USBASP_CAP_1_CHIPERASE)) {
+		fprintf(stderr, "firmware doesn't support chip erase request\n");
+		goto close;
+	}
+
+	request(USBASP_FUNC_CONNECT, 0, 0, reply, 0, 1);
+	if ((request(USBASP_FUNC_ENABLEPROG, 0, 0, reply, 1, 1) != 1)
+			|| (reply[0] != 0)) {
+		fprintf(stderr, "target doesn't answer\n");
+		goto disconnect;
+	}
+
+	if (run(TRANSPORT_CONTROL, data, size, pagesize) != 0) {
+		goto disconnect;
+	}
+
+	if (caps[1] & USBASP_CAP_1_STREAM_WRITE) {
+		if (run(TRANSPORT_STREAM, data, size, pagesize) != 0) {
+			goto disconnect;
+		}
+	} else {
+		printf("interrupt  not supported by firmware\n");
+	}
+
+	rc = 0;
+
+disconnect:
+	request(USBASP_FUNC_DISCONNECT, 0, 0, reply, 0, 1);
+close:
+	libusb_release_interface(handle, 0);
+	libusb_close(handle);
+exit:
+	libusb_exit(NULL);
+	free(data);
+	return rc;
+}